@@ -0,0 +1,389 @@
+/*****************************************************************
+*Description: Benchmarks for the cipher pipeline.
+*   USAGE: bench micro [-t threads] [-m milliseconds]
+*          bench load [-d] [-1] [-c concurrency] [-C connections]
+*                [-s size] [-n requests] port
+*   micro times cipherApply(), cipherCheck() and the seeded key
+*   stream on messages from 16 bytes to 16 MiB, each case repeated
+*   for at least -m milliseconds (200 by default).
+*   load drives the daemon on localhost:port through libotpclient
+*   with -c requests in flight (16) of -s characters (4096) each
+*   until -n requests (10000) are done, over -C connections (4) that
+*   are reused, or with -1 a new connection for every request. -d
+*   decrypts instead of encrypting. Latency runs from submission to
+*   completion.
+*   Every result is printed as one JSON object per line.
+* ***************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "cipher.h"
+#include "keystream.h"
+#include "otpclient.h"
+
+#define MICRO_SIZES 7
+
+static const long microSizes[MICRO_SIZES] = {
+   16, 256, 4096, 65536, 1 << 20, 4 << 20, 16 << 20
+};
+
+// A request of the load generator and when it was submitted
+struct slot {
+   struct otpRequest req;
+   struct otpClient *client;	// Its own, with -1
+   uint64_t start;
+};
+
+// Error function used for reporting issues
+static void error(const char *msg) {
+   perror(msg);
+   exit(1);
+}
+
+static uint64_t now(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Fills buf with len key characters drawn from seed byte s
+static char* makeText(long len, unsigned char s) {
+   unsigned char seed[KEY_SEED_BYTES];
+   char *buf = malloc(len > 0 ? len : 1);
+
+   if (buf == NULL) {
+      error("bench: out of memory");
+   }
+   memset(seed, s, sizeof(seed));
+   keystreamRange(seed, 0, len, buf);
+   return buf;
+}
+
+// Keeps the compiler from dropping work whose result is unused
+static volatile long sink;
+
+/*******************************************************************
+ *Description: Times each micro benchmark case on every size.
+ *Parameters: Minimum time per case in nanoseconds
+ * ****************************************************************/
+static void runMicro(uint64_t minTime) {
+   static const char *names[] = {"encrypt", "decrypt", "check", "keystream"};
+   unsigned char seed[KEY_SEED_BYTES] = {1};
+   uint64_t start, elapsed;
+   char *text, *key, *out;
+   long len, iterations;
+   int s, op;
+
+   for (s = 0; s < MICRO_SIZES; s++) {
+      len = microSizes[s];
+      text = makeText(len, 1);
+      key = makeText(len, 2);
+      out = malloc(len);
+      if (out == NULL) {
+	 error("bench: out of memory");
+      }
+
+      for (op = 0; op < 4; op++) {
+	 iterations = 0;
+	 start = now();
+	 do {
+	    switch (op) {
+	       case 0:
+		  cipherApply(CIPHER_ENCRYPT, out, text, key, len);
+		  break;
+	       case 1:
+		  cipherApply(CIPHER_DECRYPT, out, text, key, len);
+		  break;
+	       case 2:
+		  sink = cipherCheck(text, len);
+		  break;
+	       case 3:
+		  keystreamRange(seed, iterations * len, len, out);
+		  break;
+	    }
+	    iterations++;
+	    elapsed = now() - start;
+	 } while (elapsed < minTime);
+
+	 printf("{\"bench\":\"micro\",\"op\":\"%s\",\"size\":%ld,"
+	       "\"iterations\":%ld,\"ns_per_op\":%.1f,\"mb_per_s\":%.1f}\n",
+	       names[op], len, iterations, (double)elapsed / iterations,
+	       (double)len * iterations / elapsed * 1000);
+	 fflush(stdout);
+      }
+
+      free(text);
+      free(key);
+      free(out);
+   }
+}
+
+static int compareTimes(const void *a, const void *b) {
+   uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+   return x < y ? -1 : x > y;
+}
+
+// Latency at fraction p of the sorted times, in microseconds
+static double percentile(uint64_t *times, long n, double p) {
+   long i = (long)(p * n);
+
+   return times[i < n ? i : n - 1] / 1000.0;
+}
+
+// Exits unless the request came back intact
+static void checkResult(struct otpRequest *req, char *expect, char type) {
+   if (req->status != OTP_DONE) {
+      fprintf(stderr, "bench: request failed: %s\n", req->error);
+      exit(1);
+   }
+   if (expect != NULL) {
+      cipherApply(type == 'e' ? CIPHER_ENCRYPT : CIPHER_DECRYPT, expect,
+	    req->text, req->key, req->len);
+      if (memcmp(expect, req->out, req->len) != 0) {
+	 fprintf(stderr, "bench: daemon returned a wrong result\n");
+	 exit(1);
+      }
+   }
+}
+
+static void submit(struct slot *slot, struct otpClient *client) {
+   slot->start = now();
+   if (otpSubmit(client, &slot->req) < 0) {
+      error("bench: otpSubmit");
+   }
+}
+
+static struct otpClient* connectDaemon(int port, char type, int conns) {
+   struct otpClient *client = otpConnect("localhost", port, type, conns);
+
+   if (client == NULL) {
+      error("bench: connecting");
+   }
+   return client;
+}
+
+/*******************************************************************
+ *Description: Runs the load generator and prints its result.
+ *Parameters: Port, handshake byte, requests in flight, connections,
+ *   new connection per request flag, message size, request count
+ * ****************************************************************/
+static void runLoad(int port, char type, int concurrency, int conns,
+      int fresh, long size, long requests) {
+   uint64_t *times = malloc(requests * sizeof(uint64_t));
+   struct slot *slots = calloc(concurrency, sizeof(struct slot));
+   struct pollfd *pfds = calloc(concurrency, sizeof(struct pollfd));
+   struct otpClient *client = NULL;
+   struct otpRequest *req;
+   struct slot *slot;
+   char *text = makeText(size, 1);
+   char *key = makeText(size, 2);
+   char *expect = malloc(size > 0 ? size : 1);
+   long issued = 0, done = 0;
+   int progress;
+   uint64_t start, elapsed;
+   int i;
+
+   if (times == NULL || slots == NULL || pfds == NULL || expect == NULL) {
+      error("bench: out of memory");
+   }
+   if (concurrency > requests) {
+      concurrency = requests;
+   }
+
+   for (i = 0; i < concurrency; i++) {
+      otpInit(&slots[i].req);
+      slots[i].req.text = text;
+      slots[i].req.key = key;
+      slots[i].req.len = size;
+      slots[i].req.out = malloc(size > 0 ? size : 1);
+      slots[i].req.user = &slots[i];
+      if (slots[i].req.out == NULL) {
+	 error("bench: out of memory");
+      }
+   }
+
+   start = now();
+   if (!fresh) {
+      client = connectDaemon(port, type, conns);
+      for (i = 0; i < concurrency; i++, issued++) {
+	 submit(&slots[i], client);
+      }
+
+      while (done < requests) {
+	 if (otpPoll(client, -1) < 0) {
+	    error("bench: otpPoll");
+	 }
+	 while ((req = otpComplete(client)) != NULL) {
+	    slot = req->user;
+	    times[done] = now() - slot->start;
+	    // Only the first result is checked, to keep the load up
+	    checkResult(req, done == 0 ? expect : NULL, type);
+	    done++;
+	    if (issued < requests) {
+	       submit(slot, client);
+	       issued++;
+	    }
+	 }
+      }
+      otpClose(client);
+   }else{
+      // Each slot connects, runs one request and hangs up
+      for (i = 0; i < concurrency; i++, issued++) {
+	 slots[i].start = now();
+	 slots[i].client = connectDaemon(port, type, 1);
+	 otpSubmit(slots[i].client, &slots[i].req);
+	 otpPoll(slots[i].client, 0);
+      }
+
+      while (done < requests) {
+	 // A request can finish inside any otpPoll(), so results are
+	 // collected before waiting on the descriptors again
+	 progress = 0;
+	 for (i = 0; i < concurrency; i++) {
+	    slot = &slots[i];
+	    if (slot->client == NULL ||
+		  (req = otpComplete(slot->client)) == NULL) {
+	       continue;
+	    }
+	    times[done] = now() - slot->start;
+	    checkResult(req, done == 0 ? expect : NULL, type);
+	    done++;
+	    progress = 1;
+	    otpClose(slot->client);
+	    slot->client = NULL;
+
+	    if (issued < requests) {
+	       slot->start = now();
+	       slot->client = connectDaemon(port, type, 1);
+	       otpSubmit(slot->client, &slot->req);
+	       otpPoll(slot->client, 0);
+	       issued++;
+	    }
+	 }
+	 if (progress) {
+	    continue;
+	 }
+
+	 for (i = 0; i < concurrency; i++) {
+	    pfds[i].fd = slots[i].client != NULL ? otpFd(slots[i].client) : -1;
+	    pfds[i].events = POLLIN;
+	 }
+	 if (poll(pfds, (unsigned)concurrency, -1) < 0 && errno != EINTR) {
+	    error("bench: poll");
+	 }
+	 for (i = 0; i < concurrency; i++) {
+	    if (slots[i].client != NULL && (pfds[i].revents & POLLIN) &&
+		  otpPoll(slots[i].client, 0) < 0) {
+	       error("bench: otpPoll");
+	    }
+	 }
+      }
+   }
+   elapsed = now() - start;
+
+   qsort(times, requests, sizeof(uint64_t), compareTimes);
+   printf("{\"bench\":\"load\",\"op\":\"%s\",\"size\":%ld,\"requests\":%ld,"
+	 "\"concurrency\":%d,\"connections\":%d,\"reuse\":%s,"
+	 "\"seconds\":%.3f,\"req_per_s\":%.1f,\"mb_per_s\":%.1f,"
+	 "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+	 type == 'e' ? "encrypt" : "decrypt", size, requests, concurrency,
+	 fresh ? concurrency : conns, fresh ? "false" : "true",
+	 elapsed / 1e9, requests / (elapsed / 1e9),
+	 (double)size * requests / elapsed * 1000,
+	 percentile(times, requests, 0.5), percentile(times, requests, 0.99),
+	 percentile(times, requests, 0.999), times[requests - 1] / 1000.0);
+
+   for (i = 0; i < concurrency; i++) {
+      free(slots[i].req.out);
+   }
+   free(slots);
+   free(pfds);
+   free(times);
+   free(text);
+   free(key);
+   free(expect);
+}
+
+static void usage(void) {
+   fprintf(stderr, "USAGE: bench micro [-t threads] [-m milliseconds]\n"
+	 "       bench load [-d] [-1] [-c concurrency] [-C connections] "
+	 "[-s size] [-n requests] port\n");
+   exit(1);
+}
+
+int main(int argc, char *argv[]) {
+   int concurrency = 16, conns = 4, threads = 1;
+   long size = 4096, requests = 10000, ms = 200;
+   int fresh = 0;
+   char type = 'e';
+   int opt;
+
+   if (argc < 2) {
+      usage();
+   }
+   // Options follow the mode
+   argv++;
+   argc--;
+
+   while ((opt = getopt(argc, argv, "t:m:d1c:C:s:n:")) != -1) {
+      switch (opt) {
+	 case 't':
+	    threads = atoi(optarg);
+	    break;
+	 case 'm':
+	    ms = atol(optarg);
+	    break;
+	 case 'd':
+	    type = 'd';
+	    break;
+	 case '1':
+	    fresh = 1;
+	    break;
+	 case 'c':
+	    concurrency = atoi(optarg);
+	    break;
+	 case 'C':
+	    conns = atoi(optarg);
+	    break;
+	 case 's':
+	    size = atol(optarg);
+	    break;
+	 case 'n':
+	    requests = atol(optarg);
+	    break;
+	 default:
+	    usage();
+      }
+   }
+
+   if (strcmp(argv[0], "micro") == 0) {
+      if (threads < 1 || ms < 1 || optind != argc) {
+	 usage();
+      }
+      if (threads > 1 && cipherStartThreads(threads) < 0) {
+	 error("bench: starting cipher threads");
+      }
+      runMicro(ms * 1000000);
+   }else if (strcmp(argv[0], "load") == 0) {
+      if (optind != argc - 1 || concurrency < 1 || conns < 1 || size < 0 ||
+	    requests < 1) {
+	 usage();
+      }
+      signal(SIGPIPE, SIG_IGN);
+      runLoad(atoi(argv[optind]), type, concurrency, conns, fresh, size,
+	    requests);
+   }else{
+      usage();
+   }
+   return 0;
+}
@@ -0,0 +1,367 @@
+/*****************************************************************
+*Description: Cipher core shared by the daemons and clients.
+*
+*   Every symbol is mapped to 0-26 ('A' is 0, space is 26), text and
+*   key are added or subtracted, the sum is brought back into 0-26
+*   and mapped back to a character. The scalar loop looks all of it
+*   up: a byte table gives the symbol numbers and a 27x27 table the
+*   result character. The vector kernels work it out with compares
+*   and masks, 16 or 32 characters at a time, and leave the tail to
+*   the scalar loop.
+*
+*   Large calls are cut into blocks that the caller and the cipher
+*   threads take in turn. The cipher is position-wise, so blocks are
+*   independent and need no ordering.
+* ***************************************************************/
+
+#include <pthread.h>
+
+#include "cipher.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+// Calls at least this long are shared with the cipher threads
+#define PARALLEL_MIN (256 * 1024)
+// Characters taken at a time, small enough to stay in cache
+#define BLOCK_SIZE (64 * 1024)
+
+typedef void (*kernel)(char *out, const char *text, const char *key,
+      long len);
+typedef long (*scanner)(const char *buf, long len);
+
+// The call being shared with the cipher threads
+static struct {
+   pthread_mutex_t call;	// Held by the caller using the threads
+   pthread_mutex_t lock;	// Guards everything below but next
+   pthread_cond_t start, finished;
+   unsigned long generation;	// Bumped for every call
+   int threads;			// Helper threads running
+   int busy;			// Helpers not yet done with this call
+   kernel run;
+   char *out;
+   const char *text, *key;
+   long len;
+   long next;			// Start of the next free block
+} pool = {
+   PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+   PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+// Kernel for each direction
+static kernel kernels[2];
+static scanner checkKernel;
+
+// Symbol number of every byte
+static unsigned char symbolOf[256];
+// Result character for each pair of text and key symbol numbers
+static char encryptTable[27][27];
+static char decryptTable[27][27];
+
+static void lookup(char table[27][27], char *out, const char *text,
+      const char *key, long len) {
+   long i;
+
+   for (i = 0; i < len; i++) {
+      out[i] = table[symbolOf[(unsigned char)text[i]]]
+	 [symbolOf[(unsigned char)key[i]]];
+   }
+}
+
+static void encryptScalar(char *out, const char *text, const char *key,
+      long len) {
+   lookup(encryptTable, out, text, key, len);
+}
+
+static void decryptScalar(char *out, const char *text, const char *key,
+      long len) {
+   lookup(decryptTable, out, text, key, len);
+}
+
+static long checkScalar(const char *buf, long len) {
+   long i;
+
+   for (i = 0; i < len; i++) {
+      if ((buf[i] < 'A' || buf[i] > 'Z') && buf[i] != ' ') {
+	 break;
+      }
+   }
+   return i;
+}
+
+#ifdef HAVE_X86
+
+// 16 characters to symbol numbers
+__attribute__((target("sse4.1")))
+static inline __m128i symbols128(__m128i c) {
+   __m128i space = _mm_cmpeq_epi8(c, _mm_set1_epi8(' '));
+   return _mm_blendv_epi8(_mm_sub_epi8(c, _mm_set1_epi8('A')),
+	 _mm_set1_epi8(26), space);
+}
+
+// 16 symbol numbers to characters
+__attribute__((target("sse4.1")))
+static inline __m128i characters128(__m128i s) {
+   __m128i space = _mm_cmpeq_epi8(s, _mm_set1_epi8(26));
+   return _mm_blendv_epi8(_mm_add_epi8(s, _mm_set1_epi8('A')),
+	 _mm_set1_epi8(' '), space);
+}
+
+__attribute__((target("sse4.1")))
+static void encryptSse4(char *out, const char *text, const char *key,
+      long len) {
+   __m128i s, over;
+   long i;
+
+   for (i = 0; i + 16 <= len; i += 16) {
+      s = _mm_add_epi8(
+	    symbols128(_mm_loadu_si128((const __m128i*)(text + i))),
+	    symbols128(_mm_loadu_si128((const __m128i*)(key + i))));
+      // Sums run 0-52, take 27 off those past 26
+      over = _mm_cmpgt_epi8(s, _mm_set1_epi8(26));
+      s = _mm_sub_epi8(s, _mm_and_si128(over, _mm_set1_epi8(27)));
+      _mm_storeu_si128((__m128i*)(out + i), characters128(s));
+   }
+   encryptScalar(out + i, text + i, key + i, len - i);
+}
+
+__attribute__((target("sse4.1")))
+static void decryptSse4(char *out, const char *text, const char *key,
+      long len) {
+   __m128i s, under;
+   long i;
+
+   for (i = 0; i + 16 <= len; i += 16) {
+      s = _mm_sub_epi8(
+	    symbols128(_mm_loadu_si128((const __m128i*)(text + i))),
+	    symbols128(_mm_loadu_si128((const __m128i*)(key + i))));
+      // Differences run -26-26, add 27 to those below 0
+      under = _mm_cmpgt_epi8(_mm_setzero_si128(), s);
+      s = _mm_add_epi8(s, _mm_and_si128(under, _mm_set1_epi8(27)));
+      _mm_storeu_si128((__m128i*)(out + i), characters128(s));
+   }
+   decryptScalar(out + i, text + i, key + i, len - i);
+}
+
+__attribute__((target("sse4.1")))
+static long checkSse4(const char *buf, long len) {
+   __m128i c, ok;
+   int bad;
+   long i;
+
+   for (i = 0; i + 16 <= len; i += 16) {
+      c = _mm_loadu_si128((const __m128i*)(buf + i));
+      // Bytes past 127 compare as negative and fail the letter test
+      ok = _mm_or_si128(_mm_and_si128(
+	       _mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)),
+	       _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), c)),
+	    _mm_cmpeq_epi8(c, _mm_set1_epi8(' ')));
+      bad = ~_mm_movemask_epi8(ok) & 0xffff;
+      if (bad) {
+	 return i + __builtin_ctz(bad);
+      }
+   }
+   return i + checkScalar(buf + i, len - i);
+}
+
+// 32 characters to symbol numbers
+__attribute__((target("avx2")))
+static inline __m256i symbols256(__m256i c) {
+   __m256i space = _mm256_cmpeq_epi8(c, _mm256_set1_epi8(' '));
+   return _mm256_blendv_epi8(_mm256_sub_epi8(c, _mm256_set1_epi8('A')),
+	 _mm256_set1_epi8(26), space);
+}
+
+// 32 symbol numbers to characters
+__attribute__((target("avx2")))
+static inline __m256i characters256(__m256i s) {
+   __m256i space = _mm256_cmpeq_epi8(s, _mm256_set1_epi8(26));
+   return _mm256_blendv_epi8(_mm256_add_epi8(s, _mm256_set1_epi8('A')),
+	 _mm256_set1_epi8(' '), space);
+}
+
+__attribute__((target("avx2")))
+static void encryptAvx2(char *out, const char *text, const char *key,
+      long len) {
+   __m256i s, over;
+   long i;
+
+   for (i = 0; i + 32 <= len; i += 32) {
+      s = _mm256_add_epi8(
+	    symbols256(_mm256_loadu_si256((const __m256i*)(text + i))),
+	    symbols256(_mm256_loadu_si256((const __m256i*)(key + i))));
+      over = _mm256_cmpgt_epi8(s, _mm256_set1_epi8(26));
+      s = _mm256_sub_epi8(s, _mm256_and_si256(over, _mm256_set1_epi8(27)));
+      _mm256_storeu_si256((__m256i*)(out + i), characters256(s));
+   }
+   encryptScalar(out + i, text + i, key + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void decryptAvx2(char *out, const char *text, const char *key,
+      long len) {
+   __m256i s, under;
+   long i;
+
+   for (i = 0; i + 32 <= len; i += 32) {
+      s = _mm256_sub_epi8(
+	    symbols256(_mm256_loadu_si256((const __m256i*)(text + i))),
+	    symbols256(_mm256_loadu_si256((const __m256i*)(key + i))));
+      under = _mm256_cmpgt_epi8(_mm256_setzero_si256(), s);
+      s = _mm256_add_epi8(s, _mm256_and_si256(under, _mm256_set1_epi8(27)));
+      _mm256_storeu_si256((__m256i*)(out + i), characters256(s));
+   }
+   decryptScalar(out + i, text + i, key + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static long checkAvx2(const char *buf, long len) {
+   __m256i c, ok;
+   unsigned bad;
+   long i;
+
+   for (i = 0; i + 32 <= len; i += 32) {
+      c = _mm256_loadu_si256((const __m256i*)(buf + i));
+      ok = _mm256_or_si256(_mm256_and_si256(
+	       _mm256_cmpgt_epi8(c, _mm256_set1_epi8('A' - 1)),
+	       _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), c)),
+	    _mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')));
+      bad = ~(unsigned)_mm256_movemask_epi8(ok);
+      if (bad) {
+	 return i + __builtin_ctz(bad);
+      }
+   }
+   return i + checkScalar(buf + i, len - i);
+}
+
+#endif
+
+// Fills the tables and picks the kernels for this CPU before main()
+__attribute__((constructor))
+static void setupCipher(void) {
+   const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+   int t, k;
+
+   // Bytes outside the alphabet read as 'A'
+   for (t = 0; t < 27; t++) {
+      symbolOf[(unsigned char)alphabet[t]] = t;
+   }
+   for (t = 0; t < 27; t++) {
+      for (k = 0; k < 27; k++) {
+	 encryptTable[t][k] = alphabet[(t + k) % 27];
+	 decryptTable[t][k] = alphabet[(t - k + 27) % 27];
+      }
+   }
+
+   kernels[CIPHER_ENCRYPT] = encryptScalar;
+   kernels[CIPHER_DECRYPT] = decryptScalar;
+   checkKernel = checkScalar;
+
+#ifdef HAVE_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2")) {
+      kernels[CIPHER_ENCRYPT] = encryptAvx2;
+      kernels[CIPHER_DECRYPT] = decryptAvx2;
+      checkKernel = checkAvx2;
+   }else if (__builtin_cpu_supports("sse4.1")) {
+      kernels[CIPHER_ENCRYPT] = encryptSse4;
+      kernels[CIPHER_DECRYPT] = decryptSse4;
+      checkKernel = checkSse4;
+   }
+#endif
+}
+
+// Ciphers blocks of the shared call until none are left
+static void takeBlocks(void) {
+   long start, n;
+
+   while ((start = __atomic_fetch_add(&pool.next, BLOCK_SIZE,
+		 __ATOMIC_RELAXED)) < pool.len) {
+      n = pool.len - start < BLOCK_SIZE ? pool.len - start : BLOCK_SIZE;
+      pool.run(pool.out + start, pool.text + start, pool.key + start, n);
+   }
+}
+
+// Helper thread: joins every shared call, then reports back
+static void* helper(void *arg) {
+   unsigned long seen = 0;
+
+   pthread_mutex_lock(&pool.lock);
+   while (1) {
+      while (pool.generation == seen) {
+	 pthread_cond_wait(&pool.start, &pool.lock);
+      }
+      seen = pool.generation;
+      pthread_mutex_unlock(&pool.lock);
+
+      takeBlocks();
+
+      pthread_mutex_lock(&pool.lock);
+      if (--pool.busy == 0) {
+	 pthread_cond_signal(&pool.finished);
+      }
+   }
+   return NULL;
+}
+
+int cipherStartThreads(int threads) {
+   pthread_attr_t attr;
+   pthread_t thread;
+   int rc = 0;
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+   // The caller is one of the threads
+   pthread_mutex_lock(&pool.lock);
+   while (pool.threads < threads - 1) {
+      if (pthread_create(&thread, &attr, helper, NULL) != 0) {
+	 rc = -1;
+	 break;
+      }
+      pool.threads++;
+   }
+   pthread_mutex_unlock(&pool.lock);
+
+   pthread_attr_destroy(&attr);
+   return rc;
+}
+
+void cipherApply(enum cipherDirection dir, char *out, const char *text,
+      const char *key, long len) {
+   // Short calls, or calls while another caller has the threads, run
+   // on the calling thread alone
+   if (pool.threads == 0 || len < PARALLEL_MIN ||
+	 pthread_mutex_trylock(&pool.call) != 0) {
+      kernels[dir](out, text, key, len);
+      return;
+   }
+
+   pthread_mutex_lock(&pool.lock);
+   pool.run = kernels[dir];
+   pool.out = out;
+   pool.text = text;
+   pool.key = key;
+   pool.len = len;
+   pool.next = 0;
+   pool.busy = pool.threads;
+   pool.generation++;
+   pthread_cond_broadcast(&pool.start);
+   pthread_mutex_unlock(&pool.lock);
+
+   takeBlocks();
+
+   // Every helper has to check in before the buffers go back
+   pthread_mutex_lock(&pool.lock);
+   while (pool.busy > 0) {
+      pthread_cond_wait(&pool.finished, &pool.lock);
+   }
+   pthread_mutex_unlock(&pool.lock);
+   pthread_mutex_unlock(&pool.call);
+}
+
+long cipherCheck(const char *buf, long len) {
+   return checkKernel(buf, len);
+}
@@ -0,0 +1,40 @@
+/*****************************************************************
+*Description: Cipher core shared by the daemons and clients. Text and key are
+*   over the 27 symbol alphabet, 'A'-'Z' and space.
+* ***************************************************************/
+#ifndef CIPHER_H
+#define CIPHER_H
+
+enum cipherDirection {
+   CIPHER_ENCRYPT,
+   CIPHER_DECRYPT
+};
+
+/*******************************************************************
+ *Description: Starts cipher threads, counting the caller, that
+ *   cipherApply() shares long calls with. Calls below a few hundred
+ *   kilobytes stay on the calling thread.
+ *Parameters: Thread count
+ *Returns: 0 on success, -1 if a thread could not be started
+ * ****************************************************************/
+int cipherStartThreads(int threads);
+
+/*******************************************************************
+ *Description: Ciphers len characters of text with key into out. Out
+ *   may be text itself; text and key are never modified. The widest
+ *   vector unit the CPU has is used, and every variant gives the same
+ *   output. Characters outside the alphabet give unspecified output.
+ *Parameters: Direction, output, text, key, length
+ * ****************************************************************/
+void cipherApply(enum cipherDirection dir, char *out, const char *text,
+      const char *key, long len);
+
+/*******************************************************************
+ *Description: Finds the first character outside the alphabet, with
+ *   the same vector unit as cipherApply().
+ *Parameters: Buffer, length
+ *Returns: Index of the first bad character, len if there is none
+ * ****************************************************************/
+long cipherCheck(const char *buf, long len);
+
+#endif
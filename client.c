@@ -0,0 +1,985 @@
+/*******************************************************************
+ * Description: Argument handling and file loading shared by
+ *    enc_client and dec_client, which run their jobs through
+ *    libotpclient (see otpclient.h). Text and key files are mapped,
+ *    checked with a vector scan and sent with sendfile(), so their
+ *    bytes never pass through a user space buffer. Streams from
+ *    stdin are read and sent in chunks instead.
+ * ****************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>  // ssize_t
+#include <sys/socket.h> // send(),recv()
+#include <sys/stat.h>
+#include <sys/mman.h>   // mmap()
+#include <sys/un.h>
+#include <netdb.h>      // gethostbyname()
+#include <netinet/in.h>
+
+#include "cipher.h"
+#include "client.h"
+#include "protocol.h"
+#include "keystore.h"
+#include "otpclient.h"
+
+// Memory shared with a daemon on its Unix socket
+#define SHARED_BYTES (64L << 20)
+// Bytes of a stream read per chunk, and chunks in flight
+#define STREAM_CHUNK (64 << 10)
+#define STREAM_SLOTS 32
+
+// A text or key file, mapped when it can be
+struct input {
+   char *data;
+   long len;		// Characters before EOF or the first \n
+   long mapped;		// Bytes mapped, 0 if the data was read in
+   int fd;		// File the characters are sent from, or -1
+};
+
+// One text/key pair and where its result goes. The files are only
+// opened once the job is handed to a connection.
+struct job {
+   char *textFile;
+   char *keyFile;	// Or @id:offset, naming a daemon pad
+   char *outFile;	// Result file, NULL for stdout
+   FILE *out;
+   struct input text;
+   struct input key;	// Unused when the daemon's pad is named
+   char *padId;		// Key ID of a daemon pad, or NULL
+   unsigned long padOffset;
+   // Text and key read into memory shared with the daemon, or NULL
+   char *sharedText;
+   char *sharedKey;
+   struct otpRequest req;
+};
+
+// A chunk of a stream. Newlines are taken out of the text before it
+// is sent and put back into the result, so they use no key.
+struct chunk {
+   char *text;		// As read, then its characters
+   char *key;		// Unused when the daemon's pad is named
+   char *out;		// The text itself when it is shared
+   char *raw;		// The chunk as read if it had newlines
+   long rawLen;		// 0 if it had none
+   struct otpRequest req;
+};
+
+// Error function used for reporting issues
+void error(const char *msg) {
+   perror(msg);
+   exit(1);
+}
+
+// Set up the address struct
+static void setupAddressStruct(struct sockaddr_in* address, int portNumber,
+      char* hostname){
+
+   // Clear out the address struct
+   memset((char*) address, '\0', sizeof(*address));
+
+   // The address should be network capable
+   address->sin_family = AF_INET;
+   // Store the port number
+   address->sin_port = htons(portNumber);
+
+   // Get the DNS entry for this host name
+   struct hostent* hostInfo = gethostbyname(hostname);
+   if (hostInfo == NULL) {
+      fprintf(stderr, "CLIENT: ERROR, no such host\n");
+      exit(0);
+   }
+   // Copy the first IP address from the DNS entry to sin_addr.s_addr
+   memcpy((char*) &address->sin_addr.s_addr,
+	 hostInfo->h_addr_list[0],
+	 hostInfo->h_length);
+}
+
+/***************************************************************
+ * Description: Reads a file that cannot be mapped, such as a pipe,
+ *    up to EOF or the first \n.
+ * Parameters: Open file, Result Length
+ * *************************************************************/
+static char* readFile(int fd, long* length) {
+   long cap = 4096;
+   long i = 0;
+   char* buff = malloc(cap);
+   char* nl;
+   ssize_t n;
+
+   while (1) {
+      if (i == cap) {
+	 cap *= 2;
+	 buff = realloc(buff, cap);
+	 if (buff == NULL) {
+	    error("CLIENT: out of memory");
+	 }
+      }
+
+      n = read(fd, buff + i, cap - i);
+      if (n < 0 && errno == EINTR) {
+	 continue;
+      }
+      if (n < 0) {
+	 error("CLIENT: Could not process file");
+      }
+      if (n == 0) {
+	 break;
+      }
+
+      // Stop at \n
+      nl = memchr(buff + i, '\n', n);
+      if (nl != NULL) {
+	 i = nl - buff;
+	 break;
+      }
+      i += n;
+   }
+
+   *length = i;
+   return buff;
+}
+
+/***************************************************************
+ * Description: Loads the passed file and sets its length to the
+ *    characters before EOF or the first \n, of which only capital
+ *    letters and spaces are accepted. Regular files are mapped and
+ *    later sent straight from the page cache.
+ * Parameters: File name, input to fill
+ * *************************************************************/
+static void loadFile(char* file, struct input* in) {
+   int fd = open(file, O_RDONLY);
+   struct stat st;
+   char* nl;
+
+   if (fd < 0) {
+      error("CLIENT: Could not process file");
+   }
+
+   in->fd = -1;
+   in->mapped = 0;
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      in->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (in->data != MAP_FAILED) {
+	 madvise(in->data, st.st_size, MADV_SEQUENTIAL);
+	 in->mapped = st.st_size;
+	 in->fd = fd;
+      }
+   }
+
+   if (in->mapped) {
+      nl = memchr(in->data, '\n', in->mapped);
+      in->len = nl != NULL ? nl - in->data : in->mapped;
+   }else{
+      in->data = readFile(fd, &in->len);
+      close(fd);
+   }
+
+   if (cipherCheck(in->data, in->len) != in->len) {
+      fprintf(stderr, "Bad character input.\n");
+      exit(1);
+   }
+}
+
+static void freeInput(struct input* in) {
+   if (in->mapped) {
+      munmap(in->data, in->mapped);
+      close(in->fd);
+   }else{
+      free(in->data);
+   }
+}
+
+// Exits unless the handshake reply names the daemon we asked for
+static void checkAccepted(char verify, char type) {
+   //Client not permitted access
+   if (verify != type) {
+      fprintf(stderr, "Client not accepted by %s\n",
+	    type == 'e' ? "dec_server" : "enc_server");
+      exit(2);
+   }
+}
+
+// Writes all of buf, blocking as needed
+static void writeAll(int socketFD, char *buf, long len, const char *msg) {
+   ssize_t n;
+
+   while (len > 0) {
+      n = write(socketFD, buf, len);
+      if (n < 0 && errno == EINTR) {
+	 continue;
+      }
+      if (n <= 0) {
+	 error(msg);
+      }
+      buf += n;
+      len -= n;
+   }
+}
+
+// Reads a key given as @id:offset, naming a pad held by the daemon
+static void parsePadRef(char *ref, struct job *job) {
+   char *colon = strrchr(ref, ':');
+   char *end;
+
+   if (colon == NULL || colon == ref + 1 || colon - ref - 1 > KEY_ID_MAX) {
+      fprintf(stderr, "CLIENT: key reference must be @id:offset\n");
+      exit(1);
+   }
+   job->padOffset = strtoul(colon + 1, &end, 10);
+   if (*end != '\0' || colon[1] == '\0') {
+      fprintf(stderr, "CLIENT: key reference must be @id:offset\n");
+      exit(1);
+   }
+   job->padId = strndup(ref + 1, colon - ref - 1);
+
+   memset(&job->key, 0, sizeof(job->key));
+   job->key.fd = -1;
+}
+
+// Writes a piece of a job's result as it arrives, and \n at its end
+static void writeResult(struct otpRequest *req, const char *data, long len) {
+   struct job *job = req->user;
+
+   if (len == 0) {
+      fputc('\n', job->out);
+   }else{
+      fwrite(data, 1, len, job->out);
+   }
+}
+
+/****************************************************************
+ * Description: Loads the job's files, checks that the key covers
+ *    the text and opens the output the result goes to.
+ * Parameters: Job, handshake byte, original protocol flag
+ * **************************************************************/
+static void startJob(struct job *job, char type, int legacy) {
+   // Process Files, unless shareFiles() read them in
+   if (job->sharedText == NULL) {
+      loadFile(job->textFile, &job->text);
+   }
+   job->padId = NULL;
+   if (job->keyFile[0] == '@') {
+      if (legacy) {
+	 fprintf(stderr, "CLIENT: the original protocol cannot name a key\n");
+	 exit(1);
+      }
+      parsePadRef(job->keyFile, job);
+   }else if (job->sharedText == NULL) {
+      loadFile(job->keyFile, &job->key);
+
+      // Check that key is adequate
+      if (job->key.len < job->text.len) {
+	 fprintf(stderr, "Key is shorter than %s.",
+	       type == 'e' ? "plaintext" : "cyphertext");
+	 exit(1);
+      }
+   }
+
+   job->out = stdout;
+   if (job->outFile != NULL) {
+      job->out = fopen(job->outFile, "w");
+      if (job->out == NULL) {
+	 error("CLIENT: Could not open output file");
+      }
+   }
+
+   otpInit(&job->req);
+   job->req.text = job->sharedText != NULL ? job->sharedText : job->text.data;
+   job->req.len = job->text.len;
+   job->req.textFd = job->text.fd;
+   job->req.key = job->sharedKey != NULL ? job->sharedKey : job->key.data;
+   job->req.keyFd = job->key.fd;
+   job->req.padId = job->padId;
+   job->req.padOffset = job->padOffset;
+   job->req.sink = writeResult;
+   job->req.user = job;
+}
+
+// Lets go of the job's files
+static void finishJob(struct job *job) {
+   if (job->out != stdout && fclose(job->out) != 0) {
+      error("CLIENT: Could not write output file");
+   }
+   freeInput(&job->text);
+   freeInput(&job->key);
+   free(job->padId);
+}
+
+/****************************************************************
+ * Description: Runs the job over the original protocol, waiting
+ *    for the server's ack after the handshake and after the text.
+ *    For daemons that predate the framed protocol.
+ * Parameters: Job, Destination Socket, handshake byte
+ * **************************************************************/
+static void sendLegacy(struct job *job, int socketFD, char type) {
+   long len = job->text.len;
+   char* result;
+   long got = 0;
+   char verify;
+   ssize_t n;
+
+   if (len < 0 || len > MAX_SIZE) {
+      fprintf(stderr, "CLIENT: text is too long for the original protocol\n");
+      exit(1);
+   }
+   // The server would wait forever for text that never comes
+   if (len == 0) {
+      fputc('\n', job->out);
+      return;
+   }
+
+   //Send handshake to server
+   writeAll(socketFD, &type, 1, "CLIENT: error verifying with server.");
+   if (read(socketFD, &verify, 1) < 1) {
+      error("CLIENT: no handshake response from server.");
+   }
+   checkAccepted(verify, type);
+
+   //Send text to server and wait until it is read
+   writeAll(socketFD, job->text.data, len, "CLIENT: Text was not sent.");
+   if (read(socketFD, &verify, 1) < 1) {
+      error("CLIENT: Did not recieve ping from server.");
+   }
+
+   //Send key to server
+   writeAll(socketFD, job->key.data, len, "CLIENT: Failed to send key to server.");
+
+   //Get result from server
+   result = malloc(len);
+   while (got < len) {
+      n = read(socketFD, result + got, len - got);
+      if (n < 0 && errno == EINTR) {
+	 continue;
+      }
+      if (n <= 0) {
+	 error("CLIENT: Failed to receive result");
+      }
+      got += n;
+   }
+
+   fwrite(result, 1, len, job->out);
+   fputc('\n', job->out);
+   free(result);
+}
+
+// Whether the daemon is named by the path of its Unix socket
+static int isLocal(const char *where) {
+   return strchr(where, '/') != NULL;
+}
+
+// Opens a connection to the daemon on a localhost port or Unix socket
+static int connectServer(const char *where) {
+   struct sockaddr_in serverAddress;
+   struct sockaddr_un localAddress;
+   int socketFD;
+
+   // Create a socket
+   socketFD = socket(isLocal(where) ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+   if (socketFD < 0){
+      error("CLIENT: ERROR opening socket");
+   }
+
+   if (isLocal(where)) {
+      memset(&localAddress, 0, sizeof(localAddress));
+      localAddress.sun_family = AF_UNIX;
+      strncpy(localAddress.sun_path, where, sizeof(localAddress.sun_path) - 1);
+      if (connect(socketFD, (struct sockaddr*)&localAddress,
+	       sizeof(localAddress)) < 0) {
+	 error("CLIENT: ERROR connecting");
+      }
+      return socketFD;
+   }
+
+   // Set up the server address struct
+   setupAddressStruct(&serverAddress, atoi(where), "localhost");
+
+   // Connect to server
+   if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0){
+      error("CLIENT: ERROR connecting");
+   }
+   return socketFD;
+}
+
+// Reads up to len bytes of a file from its start, returning how many
+// there were
+static long readAll(int fd, char *buf, long len) {
+   long got = 0;
+   ssize_t n;
+
+   while (got < len) {
+      n = read(fd, buf + got, len - got);
+      if (n < 0 && errno == EINTR) {
+	 continue;
+      }
+      if (n < 0) {
+	 error("CLIENT: Could not process file");
+      }
+      if (n == 0) {
+	 break;
+      }
+      got += n;
+   }
+   return got;
+}
+
+/****************************************************************
+ * Description: Reads the job's text, and its key unless it names a
+ *    daemon pad, straight into memory shared with the daemon, which
+ *    ciphers them there instead of receiving them. The text's block
+ *    is sized for the whole file, as where it ends is not known
+ *    before it is read. Only regular files are read this way.
+ * Parameters: Client, job, handshake byte
+ * Returns: 0 once they are read, 1 to send the job over the socket
+ *    instead, -1 if the shared memory has no room for it now
+ * **************************************************************/
+static int shareFiles(struct otpClient *client, struct job *job, char type) {
+   int pad = job->keyFile[0] == '@';
+   int textFd, keyFd = -1;
+   long size, len, keyLen;
+   struct stat st, keySt;
+   char *nl;
+
+   textFd = open(job->textFile, O_RDONLY);
+   if (textFd < 0) {
+      error("CLIENT: Could not process file");
+   }
+   if (!pad && (keyFd = open(job->keyFile, O_RDONLY)) < 0) {
+      error("CLIENT: Could not process file");
+   }
+   if (fstat(textFd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+	 (!pad && (fstat(keyFd, &keySt) < 0 || !S_ISREG(keySt.st_mode)))) {
+      close(textFd);
+      close(keyFd);
+      return 1;
+   }
+   size = st.st_size;
+
+   job->sharedText = otpShareAlloc(client, size);
+   job->sharedKey = pad ? NULL : otpShareAlloc(client, size);
+   if (job->sharedText == NULL || (!pad && job->sharedKey == NULL)) {
+      otpShareFree(client, job->sharedKey);
+      otpShareFree(client, job->sharedText);
+      job->sharedText = job->sharedKey = NULL;
+      close(textFd);
+      close(keyFd);
+      return -1;
+   }
+
+   len = readAll(textFd, job->sharedText, size);
+   nl = memchr(job->sharedText, '\n', len);
+   len = nl != NULL ? nl - job->sharedText : len;
+   if (cipherCheck(job->sharedText, len) != len) {
+      fprintf(stderr, "Bad character input.\n");
+      exit(1);
+   }
+   close(textFd);
+
+   if (!pad) {
+      // Only as much key as the text uses
+      keyLen = readAll(keyFd, job->sharedKey, len);
+      nl = memchr(job->sharedKey, '\n', keyLen);
+      keyLen = nl != NULL ? nl - job->sharedKey : keyLen;
+      if (cipherCheck(job->sharedKey, keyLen) != keyLen) {
+	 fprintf(stderr, "Bad character input.\n");
+	 exit(1);
+      }
+      if (keyLen < len) {
+	 fprintf(stderr, "Key is shorter than %s.",
+	       type == 'e' ? "plaintext" : "cyphertext");
+	 exit(1);
+      }
+      close(keyFd);
+   }
+
+   job->text.len = len;
+   job->text.fd = job->key.fd = -1;
+   return 0;
+}
+
+// Connects the pool, sharing memory with a daemon on its Unix socket
+static struct otpClient* openClient(const char *where, char type,
+      int conns) {
+   struct otpClient *client;
+
+   if (isLocal(where)) {
+      client = otpConnect(where, 0, type, conns);
+      if (client != NULL && otpShare(client, SHARED_BYTES) < 0) {
+	 error("CLIENT: ERROR sharing memory");
+      }
+   }else{
+      client = otpConnect("localhost", atoi(where), type, conns);
+   }
+   if (client == NULL) {
+      error("CLIENT: ERROR connecting");
+   }
+   return client;
+}
+
+// Exits unless the request completed
+static void checkDone(struct otpRequest *req, char type) {
+   switch (req->status) {
+      case OTP_DONE:
+	 return;
+      case OTP_REJECTED:
+	 checkAccepted(0, type);
+	 break;
+      case OTP_SERVER_ERROR:
+	 fprintf(stderr, "SERVER: %s\n", req->error);
+	 exit(1);
+      default:
+	 fprintf(stderr, "CLIENT: %s\n", req->error);
+	 exit(1);
+   }
+}
+
+/****************************************************************
+ * Description: Runs the jobs over a pool of connections, keeping
+ *    every connection's window full. A job's files are only opened
+ *    when it is submitted, so a batch of any size holds a bounded
+ *    number of files.
+ *    Over the daemon's Unix socket the jobs are passed in shared
+ *    memory.
+ * Parameters: Jobs, job count, connection count, port or socket path,
+ *    handshake byte
+ * **************************************************************/
+static void runSessions(struct job *jobs, int count, int conns,
+      const char *where, char type) {
+   struct otpClient *client;
+   struct otpRequest *req;
+   struct job *job;
+   int next = 0;
+   int done = 0;
+
+   if (conns > count) {
+      conns = count;
+   }
+   client = openClient(where, type, conns);
+
+   while (done < count) {
+      while (next < count && next - done < conns * OTP_WINDOW) {
+	 job = &jobs[next];
+	 // Jobs in flight give their room back as they complete, and only
+	 // one bigger than the whole of the shared memory is sent instead
+	 if (isLocal(where) && shareFiles(client, job, type) < 0 && next > done) {
+	    break;
+	 }
+	 next++;
+	 startJob(job, type, 0);
+	 otpSubmit(client, &job->req);
+      }
+
+      if (otpPoll(client, -1) < 0) {
+	 error("CLIENT: poll");
+      }
+      while ((req = otpComplete(client)) != NULL) {
+	 checkDone(req, type);
+	 job = req->user;
+	 otpShareFree(client, job->sharedText);
+	 otpShareFree(client, job->sharedKey);
+	 finishJob(job);
+	 done++;
+      }
+   }
+
+   otpClose(client);
+}
+
+/****************************************************************
+ * Description: Reads up to len key characters, stopping for good at
+ *    EOF or the first \n.
+ * Parameters: Key file, buffer, length, set once the key has ended
+ * Returns: Characters read
+ * **************************************************************/
+static long readKey(int fd, char *buf, long len, int *ended) {
+   long got = 0;
+   char *nl;
+   ssize_t n;
+
+   while (got < len && !*ended) {
+      n = read(fd, buf + got, len - got);
+      if (n < 0 && errno == EINTR) {
+	 continue;
+      }
+      if (n < 0) {
+	 error("CLIENT: Could not process file");
+      }
+      nl = memchr(buf + got, '\n', n);
+      if (n == 0 || nl != NULL) {
+	 *ended = 1;
+	 n = nl != NULL ? nl - (buf + got) : 0;
+      }
+      got += n;
+   }
+   return got;
+}
+
+/****************************************************************
+ * Description: Reads the next chunk of stdin into a slot and
+ *    submits it with its key. A chunk of nothing but newlines is
+ *    finished at once.
+ * Parameters: Client, chunk, key source (key file or pad), key file
+ *    descriptor, set once the key has ended, handshake byte
+ * Returns: 0, or -1 at the end of stdin
+ * **************************************************************/
+static int readChunk(struct otpClient *client, struct chunk *c,
+      struct job *keys, int keyFd, int *keyEnded, char type) {
+   long len = 0;
+   ssize_t n;
+   char *nl;
+   long i;
+
+   do {
+      n = read(STDIN_FILENO, c->text, STREAM_CHUNK);
+   } while (n < 0 && errno == EINTR);
+   if (n < 0) {
+      error("CLIENT: Could not read stdin");
+   }
+   if (n == 0) {
+      return -1;
+   }
+
+   // Keep the chunk as read to put the newlines back, and cipher the
+   // rest
+   c->rawLen = 0;
+   nl = memchr(c->text, '\n', n);
+   if (nl != NULL) {
+      memcpy(c->raw, c->text, n);
+      c->rawLen = n;
+      len = nl - c->text;
+      for (i = len + 1; i < n; i++) {
+	 if (c->raw[i] != '\n') {
+	    c->text[len++] = c->raw[i];
+	 }
+      }
+   }else{
+      len = n;
+   }
+   if (cipherCheck(c->text, len) != len) {
+      fprintf(stderr, "Bad character input.\n");
+      exit(1);
+   }
+
+   otpInit(&c->req);
+   c->req.text = c->text;
+   c->req.len = len;
+   c->req.out = c->out;
+   if (len == 0) {
+      c->req.status = OTP_DONE;
+      return 0;
+   }
+
+   if (keys->padId != NULL) {
+      c->req.padId = keys->padId;
+      c->req.padOffset = keys->padOffset;
+      keys->padOffset += len;
+   }else{
+      if (readKey(keyFd, c->key, len, keyEnded) < len) {
+	 fprintf(stderr, "Key is shorter than %s.",
+	       type == 'e' ? "plaintext" : "cyphertext");
+	 exit(1);
+      }
+      c->req.key = c->key;
+   }
+   otpSubmit(client, &c->req);
+   return 0;
+}
+
+// Writes a finished chunk's result to stdout with its newlines
+static void writeChunk(struct chunk *c) {
+   const char *src = c->out;
+   char *p = c->raw;
+   char *end = c->raw + c->rawLen;
+   char *nl;
+
+   if (c->rawLen == 0) {
+      writeAll(STDOUT_FILENO, c->out, c->req.len, "CLIENT: Could not write output");
+      return;
+   }
+
+   // The result fills the gaps between the newlines
+   while (p < end) {
+      nl = memchr(p, '\n', end - p);
+      if (nl == NULL) {
+	 nl = end;
+      }
+      memcpy(p, src, nl - p);
+      src += nl - p;
+      p = nl + 1;
+   }
+   writeAll(STDOUT_FILENO, c->raw, c->rawLen, "CLIENT: Could not write output");
+}
+
+/****************************************************************
+ * Description: Ciphers stdin to stdout with a key file or daemon
+ *    pad, in chunks of STREAM_CHUNK bytes with up to STREAM_SLOTS in
+ *    flight, so memory stays bounded whatever the input and reading,
+ *    ciphering and writing overlap. Results are written in input
+ *    order. Newlines are copied through and use no key, so a
+ *    multi-line stream deciphers back to itself.
+ * Parameters: Key file or @id:offset, connection count, port or
+ *    socket path, handshake byte
+ * **************************************************************/
+static void runStream(char *keyFile, int conns, const char *where,
+      char type) {
+   struct chunk *slots = calloc(STREAM_SLOTS, sizeof(struct chunk));
+   struct otpClient *client;
+   struct otpRequest *req;
+   struct pollfd pfd[2];
+   struct job keys;
+   struct chunk *c;
+   int keyFd = -1, keyEnded = 0;
+   int head = 0, count = 0;
+   int eof = 0;
+   int i;
+
+   memset(&keys, 0, sizeof(keys));
+   if (keyFile[0] == '@') {
+      parsePadRef(keyFile, &keys);
+   }else{
+      keyFd = open(keyFile, O_RDONLY);
+      if (keyFd < 0) {
+	 error("CLIENT: Could not process file");
+      }
+   }
+
+   client = openClient(where, type, conns);
+
+   // Shared text is ciphered in place
+   for (i = 0; i < STREAM_SLOTS; i++) {
+      c = &slots[i];
+      if (isLocal(where)) {
+	 c->text = otpShareAlloc(client, STREAM_CHUNK);
+	 c->key = otpShareAlloc(client, STREAM_CHUNK);
+	 c->out = c->text;
+      }else{
+	 c->text = malloc(STREAM_CHUNK);
+	 c->key = malloc(STREAM_CHUNK);
+	 c->out = malloc(STREAM_CHUNK);
+      }
+      c->raw = malloc(STREAM_CHUNK);
+      if (c->text == NULL || c->key == NULL || c->out == NULL || c->raw == NULL) {
+	 error("CLIENT: out of memory");
+      }
+   }
+
+   while (!eof || count > 0) {
+      // Hand what is queued to the sockets, then write out the
+      // results that are next in line
+      if (otpPoll(client, 0) < 0) {
+	 error("CLIENT: poll");
+      }
+      while ((req = otpComplete(client)) != NULL) {
+	 checkDone(req, type);
+      }
+      while (count > 0 && slots[head].req.status != OTP_PENDING) {
+	 writeChunk(&slots[head]);
+	 head = (head + 1) % STREAM_SLOTS;
+	 count--;
+      }
+      if (eof && count == 0) {
+	 break;
+      }
+
+      // Wait for input while a slot is free, and for the daemon
+      pfd[0].fd = !eof && count < STREAM_SLOTS ? STDIN_FILENO : -1;
+      pfd[0].events = POLLIN;
+      pfd[1].fd = otpFd(client);
+      pfd[1].events = POLLIN;
+      if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+	 error("CLIENT: poll");
+      }
+      if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+	 c = &slots[(head + count) % STREAM_SLOTS];
+	 if (readChunk(client, c, &keys, keyFd, &keyEnded, type) < 0) {
+	    eof = 1;
+	 }else{
+	    count++;
+	 }
+      }
+   }
+
+   otpClose(client);
+   for (i = 0; i < STREAM_SLOTS; i++) {
+      if (!isLocal(where)) {
+	 free(slots[i].text);
+	 free(slots[i].key);
+	 free(slots[i].out);
+      }
+      free(slots[i].raw);
+   }
+   free(slots);
+   free(keys.padId);
+   if (keyFd >= 0) {
+      close(keyFd);
+   }
+}
+
+/****************************************************************
+ * Description: Reads a batch manifest. Each line names a text file,
+ *    a key file (or @id:offset) and the file the result is written
+ *    to, separated by blanks. Blank lines and lines starting with #
+ *    are skipped.
+ * Parameters: Manifest file, or - for stdin, job count to set
+ * Returns: The jobs
+ * **************************************************************/
+static struct job* readManifest(char *file, int *count) {
+   FILE *manifest = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+   struct job *jobs = NULL;
+   char *line = NULL;
+   size_t lineCap = 0;
+   int cap = 0;
+   int lineNo = 0;
+   char *field[4];
+   char *save;
+   int i;
+
+   if (manifest == NULL) {
+      error("CLIENT: Could not open manifest");
+   }
+
+   *count = 0;
+   while (getline(&line, &lineCap, manifest) != -1) {
+      lineNo++;
+      field[0] = strtok_r(line, " \t\r\n", &save);
+      if (field[0] == NULL || field[0][0] == '#') {
+	 continue;
+      }
+      for (i = 1; i < 4; i++) {
+	 field[i] = strtok_r(NULL, " \t\r\n", &save);
+      }
+      if (field[2] == NULL || field[3] != NULL) {
+	 fprintf(stderr, "CLIENT: %s:%d: expected text key output\n",
+	       file, lineNo);
+	 exit(1);
+      }
+
+      if (*count == cap) {
+	 cap = cap ? 2 * cap : 64;
+	 jobs = realloc(jobs, cap * sizeof(struct job));
+	 if (jobs == NULL) {
+	    error("CLIENT: out of memory");
+	 }
+      }
+      memset(&jobs[*count], 0, sizeof(struct job));
+      jobs[*count].textFile = strdup(field[0]);
+      jobs[*count].keyFile = strdup(field[1]);
+      jobs[*count].outFile = strdup(field[2]);
+      (*count)++;
+   }
+
+   free(line);
+   if (manifest != stdin) {
+      fclose(manifest);
+   }
+   return jobs;
+}
+
+static void usage(char *prog, char type) {
+   const char *text = type == 'e' ? "plaintext" : "cyphertext";
+
+   fprintf(stderr,"USAGE: %s [-l] %s key port|socket [%s key ...]\n"
+	 "       %s [-l] [-c connections] -b manifest port|socket\n"
+	 "       %s [-c connections] -s key port|socket\n",
+	 prog, text, text, prog, prog);
+   exit(0);
+}
+
+int runClient(int argc, char *argv[], char type) {
+   struct job *jobs;
+   char *manifest = NULL;
+   int conns = 4;
+   int socketFD;
+   int legacy = 0;
+   int stream = 0;
+   char *where;
+   int count;
+   int opt, i;
+
+   while ((opt = getopt(argc, argv, "lsb:c:")) != -1) {
+      switch (opt) {
+	 case 'l':
+	    legacy = 1;
+	    break;
+	 case 's':
+	    stream = 1;
+	    break;
+	 case 'b':
+	    manifest = optarg;
+	    break;
+	 case 'c':
+	    conns = atoi(optarg);
+	    break;
+	 default:
+	    usage(argv[0], type);
+      }
+   }
+
+   // A stream is its own mode, over the framed protocol
+   if (stream) {
+      if (argc - optind != 2 || conns < 1 || legacy || manifest != NULL) {
+	 usage(argv[0], type);
+      }
+      signal(SIGPIPE, SIG_IGN);
+      runStream(argv[optind], conns, argv[optind + 1], type);
+      return 0;
+   }
+
+   // Check usage & args
+   if (manifest != NULL) {
+      if (argc - optind != 1 || conns < 1) {
+	 usage(argv[0], type);
+      }
+      where = argv[optind];
+      jobs = readManifest(manifest, &count);
+   }else{
+      if (argc - optind < 3 || (argc - optind - 3) % 2 != 0) {
+	 usage(argv[0], type);
+      }
+      where = argv[optind + 2];
+
+      // Pairs after the port join the session, results go to stdout
+      // in order, so they share one connection
+      count = (argc - optind - 1) / 2;
+      conns = 1;
+      jobs = calloc(count, sizeof(struct job));
+      for (i = 0; i < count; i++) {
+	 char **pair = argv + optind + (i == 0 ? 0 : 2 * i + 1);
+
+	 jobs[i].textFile = pair[0];
+	 jobs[i].keyFile = pair[1];
+      }
+   }
+
+   // A server that hangs up on us is reported, not fatal mid write
+   signal(SIGPIPE, SIG_IGN);
+
+   // Start sending to server
+   if (legacy) {
+      // The original protocol takes one job per connection
+      for (i = 0; i < count; i++) {
+	 startJob(&jobs[i], type, 1);
+	 socketFD = connectServer(where);
+	 sendLegacy(&jobs[i], socketFD, type);
+	 close(socketFD);
+	 finishJob(&jobs[i]);
+      }
+   }else if (count > 0) {
+      runSessions(jobs, count, conns, where, type);
+   }
+
+   if (manifest != NULL) {
+      for (i = 0; i < count; i++) {
+	 free(jobs[i].textFile);
+	 free(jobs[i].keyFile);
+	 free(jobs[i].outFile);
+      }
+   }
+   free(jobs);
+   return 0;
+}
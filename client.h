@@ -0,0 +1,36 @@
+/*****************************************************************
+*Description: Argument handling and file loading shared by
+*   enc_client and dec_client. The framed exchange is in
+*   libotpclient (see otpclient.h).
+* ***************************************************************/
+#ifndef CLIENT_H
+#define CLIENT_H
+
+void error(const char *msg);
+
+/*******************************************************************
+ *Description: Sends the text and key files to the daemon on the
+ *   given port and prints the result it streams back.
+ *   USAGE: prog [-l] text key port|socket [text key ...]
+ *          prog [-l] [-c connections] -b manifest port|socket
+ *          prog [-c connections] -s key port|socket
+ *   A port given as a path names the daemon's Unix socket (see -L of
+ *   the daemons); framed jobs then pass their text and key in memory
+ *   shared with the daemon rather than through the socket.
+ *   With -s stdin is ciphered to stdout as a stream of any length and
+ *   any number of lines, a chunk at a time; newlines pass through
+ *   and use no key.
+ *   Extra pairs after the port are run over the same connection and
+ *   their results printed in order, one per line.
+ *   -b runs every "text key output" line of the manifest, spread over
+ *   -c connections (4 by default) with many jobs in flight on each,
+ *   and writes each result to its output file.
+ *   -l talks the original ack based protocol, for older daemons.
+ *   A key given as @id:offset names a pad the daemon holds (see
+ *   keystore.h), which is used from that offset on.
+ *Parameters: argc/argv of the client, handshake byte of the daemon
+ *   it talks to ('e' or 'd')
+ * ****************************************************************/
+int runClient(int argc, char *argv[], char type);
+
+#endif
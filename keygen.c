@@ -1,45 +1,340 @@
 /****************************************************************
  * Author: Brenden Smith
  * Description: Creates key of passed size+1
+ *    USAGE: keygen [-o file] [-s seed | -S] [-t threads] [-f offset]
+ *       keylength
+ *    By default random bytes come from getrandom() in large
+ *    batches. Bytes past the last whole multiple of 27 are thrown
+ *    away so every character is equally likely, and the key is
+ *    written out in large blocks as it is made, so memory use does
+ *    not grow with the key. -o writes it to a file instead of stdout.
+ *    -s makes a seeded key instead (see keystream.h) from a seed of
+ *    64 hex digits, and -S from one drawn at random and printed on
+ *    stderr. -f starts a seeded key at that character, so any range
+ *    of it can be made again, and with -o the file is sized up front
+ *    and -t threads each write their own part of it.
  * *************************************************************/
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#include "keystream.h"
+
+#define RANDOM_BATCH 65536
+#define OUT_SIZE (1 << 20)
+
+static const char alphabet[] = KEY_ALPHABET;
+
+// Part of a seeded key one thread writes
+struct range {
+   unsigned char *seed;
+   unsigned long start;	// First key character
+   long len;
+   int fd;
+   off_t offset;	// Where the range goes in the file
+};
+
+// Error function used for reporting issues
+static void error(const char *msg) {
+   perror(msg);
+   exit(1);
+}
+
+// Fills buf from the kernel's CSPRNG
+static void fillRandom(unsigned char *buf, size_t len) {
+   ssize_t n;
+
+   while (len > 0) {
+      n = getrandom(buf, len, 0);
+      if (n < 0) {
+	 if (errno == EINTR) {
+	    continue;
+	 }
+	 error("keygen: getrandom");
+      }
+      buf += n;
+      len -= n;
+   }
+}
+
+// Writes all of buf to stdout
+static void writeAll(const char *buf, size_t len) {
+   ssize_t n;
+
+   while (len > 0) {
+      n = write(STDOUT_FILENO, buf, len);
+      if (n < 0) {
+	 if (errno == EINTR) {
+	    continue;
+	 }
+	 error("keygen: write");
+      }
+      buf += n;
+      len -= n;
+   }
+}
+
+// Writes all of buf at offset in fd
+static void pwriteAll(int fd, const char *buf, size_t len, off_t offset) {
+   ssize_t n;
+
+   while (len > 0) {
+      n = pwrite(fd, buf, len, offset);
+      if (n < 0) {
+	 if (errno == EINTR) {
+	    continue;
+	 }
+	 error("keygen: write");
+      }
+      buf += n;
+      len -= n;
+      offset += n;
+   }
+}
+
+// Thread body: makes and writes one range, a buffer at a time
+static void* writeRange(void *arg) {
+   struct range *range = arg;
+   char *buffer = malloc(OUT_SIZE);
+   long done = 0;
+   long n;
+
+   if (buffer == NULL) {
+      error("keygen: out of memory");
+   }
+
+   while (done < range->len) {
+      n = range->len - done < OUT_SIZE ? range->len - done : OUT_SIZE;
+      keystreamRange(range->seed, range->start + done, n, buffer);
+      pwriteAll(range->fd, buffer, n, range->offset + done);
+      done += n;
+   }
+
+   free(buffer);
+   return NULL;
+}
+
+// Reads 64 hex digits into seed
+static int parseSeed(const char *hex, unsigned char *seed) {
+   unsigned int byte;
+   int i;
+
+   if (strlen(hex) != 2 * KEY_SEED_BYTES) {
+      return -1;
+   }
+   for (i = 0; i < KEY_SEED_BYTES; i++) {
+      if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+	 return -1;
+      }
+      seed[i] = byte;
+   }
+   return 0;
+}
+
+/****************************************************************
+ * Description: Writes keylength seeded characters from offset on,
+ *    then \n. To stdout in order, or into file split over threads.
+ * Parameters: Seed, first character, key length, output file or
+ *    NULL, thread count
+ * **************************************************************/
+static void seededKey(unsigned char *seed, unsigned long offset,
+      long keylength, char *file, int threads) {
+   struct range *ranges;
+   pthread_t *ids;
+   char *buffer;
+   long share, n, i;
+   int fd;
+
+   if (file == NULL) {
+      buffer = malloc(OUT_SIZE);
+      if (buffer == NULL) {
+	 error("keygen: out of memory");
+      }
+      for (i = 0; i < keylength; i += n) {
+	 n = keylength - i < OUT_SIZE ? keylength - i : OUT_SIZE;
+	 keystreamRange(seed, offset + i, n, buffer);
+	 writeAll(buffer, n);
+      }
+      writeAll("\n", 1);
+      free(buffer);
+      return;
+   }
+
+   fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      error("keygen: open");
+   }
+   // Size the file up front so the threads write into place
+   if (ftruncate(fd, keylength + 1) < 0) {
+      error("keygen: ftruncate");
+   }
+   posix_fallocate(fd, 0, keylength + 1);
+
+   ranges = calloc(threads, sizeof(struct range));
+   ids = calloc(threads, sizeof(pthread_t));
+   if (ranges == NULL || ids == NULL) {
+      error("keygen: out of memory");
+   }
+
+   // Whole blocks per thread, so no block is made twice, and enough of
+   // them that the threads cover the key
+   share = ((keylength + threads - 1) / threads + KEY_BLOCK - 1) /
+      KEY_BLOCK * KEY_BLOCK;
+   for (i = 0; i < threads; i++) {
+      ranges[i].seed = seed;
+      ranges[i].fd = fd;
+      ranges[i].offset = i * share < keylength ? i * share : keylength;
+      ranges[i].start = offset + ranges[i].offset;
+      ranges[i].len = keylength - ranges[i].offset < share ?
+	 keylength - ranges[i].offset : share;
+      if (pthread_create(&ids[i], NULL, writeRange, &ranges[i]) != 0) {
+	 error("keygen: pthread_create");
+      }
+   }
+   for (i = 0; i < threads; i++) {
+      pthread_join(ids[i], NULL);
+   }
+
+   pwriteAll(fd, "\n", 1, keylength);
+   if (close(fd) < 0) {
+      error("keygen: close");
+   }
+   free(ranges);
+   free(ids);
+}
+
+static void usage(void) {
+   fprintf(stderr, "USAGE: keygen [-o file] [-s seed | -S] [-t threads] "
+	 "[-f offset] keylength\n");
+   exit(1);
+}
 
 int main(int argc, char **argv) {
-   srand(time(0));
-   char randChar = ' ';
-   int randInt;
+   unsigned char seed[KEY_SEED_BYTES];
+   unsigned char *random;
    char *buffer;
+   int used = RANDOM_BATCH;
+   unsigned long offset = 0;
+   char *file = NULL;
+   int haveSeed = 0, drawSeed = 0, haveOffset = 0;
+   int threads = 1;
+   long keylength, i;
+   int fill = 0;
+   int fd, n, j, start, opt;
 
+   while ((opt = getopt(argc, argv, "t:o:s:Sf:")) != -1) {
+      switch (opt) {
+	 case 't':
+	    threads = atoi(optarg);
+	    break;
+	 case 'o':
+	    file = optarg;
+	    break;
+	 case 's':
+	    if (parseSeed(optarg, seed) < 0) {
+	       fprintf(stderr, "keygen: seed must be %d hex digits\n",
+		     2 * KEY_SEED_BYTES);
+	       exit(1);
+	    }
+	    haveSeed = 1;
+	    break;
+	 case 'S':
+	    drawSeed = 1;
+	    break;
+	 case 'f':
+	    offset = strtoul(optarg, NULL, 10);
+	    haveOffset = 1;
+	    break;
+	 default:
+	    usage();
+      }
+   }
 
-   if (argc < 2) {
+   if (optind >= argc) {
       printf("Error. Please provide keylength as parameter.\n");
       return 1;
    }
+   // Threads need a file to write into, and only a seeded key can be
+   // made in parts
+   if (threads < 1 || (threads > 1 && file == NULL) || (haveSeed && drawSeed) ||
+	 (!haveSeed && !drawSeed && (threads > 1 || haveOffset))) {
+      usage();
+   }
 
-   int keylength = atoi(argv[1]) + 1;       //Get key size
-   buffer = (char*) malloc(keylength);
-   memset(buffer, '\0', keylength);
+   keylength = atol(argv[optind]);       //Get key size
+
+   if (haveSeed || drawSeed) {
+      if (drawSeed) {
+	 fillRandom(seed, KEY_SEED_BYTES);
+	 fprintf(stderr, "keygen: seed ");
+	 for (j = 0; j < KEY_SEED_BYTES; j++) {
+	    fprintf(stderr, "%02x", seed[j]);
+	 }
+	 fprintf(stderr, "\n");
+      }
+      seededKey(seed, offset, keylength, file, threads);
+      return 0;
+   }
 
-   int i = 0;
-   for (i; i < keylength; i++) {
-      //Get random number
-      randInt = 27 * (rand() / (RAND_MAX + 1.0));
-      randInt += 65;                    //Cast to ASCII range equivelant
-      randChar = (char) randInt;        //Type cast out
+   if (file != NULL) {
+      fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+	 error("keygen: open");
+      }
+      close(fd);
+   }
+
+   random = malloc(RANDOM_BATCH);
+   buffer = malloc(OUT_SIZE);
+   if (random == NULL || buffer == NULL) {
+      error("keygen: out of memory");
+   }
+
+   for (i = 0; i < keylength; ) {
+      if (used == RANDOM_BATCH) {
+	 fillRandom(random, RANDOM_BATCH);
+	 used = 0;
+      }
+      if (fill == OUT_SIZE) {
+	 writeAll(buffer, fill);
+	 fill = 0;
+      }
+
+      // Each byte makes at most one character, so taking no more bytes
+      // than there is room and key left needs no checks in the loop
+      n = RANDOM_BATCH - used;
+      if (n > OUT_SIZE - fill) {
+	 n = OUT_SIZE - fill;
+      }
+      if (n > keylength - i) {
+	 n = keylength - i;
+      }
+
+      start = fill;
+      for (j = used; j < used + n; j++) {
+	 // Reject bytes that would favour the first characters
+	 buffer[fill] = alphabet[random[j] % 27];
+	 fill += random[j] < KEY_ACCEPT_BELOW;
+      }
+      i += fill - start;
+      used += n;
+   }
 
-      if (randChar == '[')		//Make undesireable character a space
-         buffer[i] =  ' ';
-      else
-         buffer[i] = randChar;
+   if (fill == OUT_SIZE) {
+      writeAll(buffer, fill);
+      fill = 0;
    }
-   buffer[keylength - 1] = '\n';	//Insert \n and then cap the string
-   buffer[keylength] = '\0';
+   buffer[fill++] = '\n';	//End the key with \n
+   writeAll(buffer, fill);
 
-   printf(buffer);
+   free(random);
    free(buffer);
    return 0;
 }
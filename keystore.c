@@ -0,0 +1,107 @@
+/*****************************************************************
+*Description: Pad files the daemons hold on behalf of their clients.
+*   Pads are loaded before the worker pool is forked, so every worker
+*   shares the same mappings and page cache.
+* ***************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "keystore.h"
+#include "ledger.h"
+
+static struct pad *pads;
+static int padCount;
+
+int keystoreAdd(const char *spec) {
+   const char *eq = strchr(spec, '=');
+   struct pad *grown;
+   struct stat st;
+   void *data;
+   int fd;
+
+   if (eq == NULL || eq == spec || eq - spec > KEY_ID_MAX) {
+      fprintf(stderr, "SERVER: key must be given as id=path\n");
+      return -1;
+   }
+   if (keystoreFind(spec, eq - spec) != NULL) {
+      fprintf(stderr, "SERVER: key %.*s given twice\n", (int)(eq - spec), spec);
+      return -1;
+   }
+
+   fd = open(eq + 1, O_RDONLY);
+   if (fd < 0 || fstat(fd, &st) < 0) {
+      perror(eq + 1);
+      return -1;
+   }
+   if (st.st_size == 0) {
+      fprintf(stderr, "SERVER: key file %s is empty\n", eq + 1);
+      close(fd);
+      return -1;
+   }
+   data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) {
+      perror(eq + 1);
+      return -1;
+   }
+
+   grown = realloc(pads, (padCount + 1) * sizeof(struct pad));
+   if (grown == NULL) {
+      perror("SERVER: out of memory");
+      munmap(data, st.st_size);
+      return -1;
+   }
+   pads = grown;
+
+   pads[padCount].id = strndup(spec, eq - spec);
+   pads[padCount].data = data;
+   pads[padCount].len = st.st_size;
+   pads[padCount].ledger = NULL;
+   // keygen ends its keys with \n
+   if (pads[padCount].data[st.st_size - 1] == '\n') {
+      pads[padCount].len--;
+   }
+   padCount++;
+   return 0;
+}
+
+int keystoreLedger(const char *path) {
+   char **ids = calloc(padCount + 1, sizeof(char*));
+   struct ledgerKey **keys = calloc(padCount + 1, sizeof(struct ledgerKey*));
+   int rc = -1;
+   int i;
+
+   if (ids == NULL || keys == NULL) {
+      perror("SERVER: out of memory");
+   }else{
+      for (i = 0; i < padCount; i++) {
+	 ids[i] = pads[i].id;
+      }
+      rc = ledgerOpen(path, ids, padCount, keys);
+      for (i = 0; rc == 0 && i < padCount; i++) {
+	 pads[i].ledger = keys[i];
+      }
+   }
+   free(ids);
+   free(keys);
+   return rc;
+}
+
+const struct pad* keystoreFind(const char *id, int len) {
+   int i;
+
+   // The ID comes off the wire and may hold NUL bytes, so it is
+   // compared by length
+   for (i = 0; i < padCount; i++) {
+      if (strlen(pads[i].id) == (size_t)len && memcmp(pads[i].id, id, len) == 0) {
+	 return &pads[i];
+      }
+   }
+   return NULL;
+}
@@ -0,0 +1,43 @@
+/*****************************************************************
+*Description: Pad files the daemons hold on behalf of their clients.
+*   Each pad is mapped read-only under a key ID, and a framed job can
+*   name a pad and an offset instead of sending its key.
+* ***************************************************************/
+#ifndef KEYSTORE_H
+#define KEYSTORE_H
+
+// Longest key ID
+#define KEY_ID_MAX 255
+
+struct ledgerKey;
+
+struct pad {
+   char *id;
+   const char *data;
+   long len;		// Key characters, without a trailing \n
+   struct ledgerKey *ledger;	// Its ranges used, NULL without a ledger
+};
+
+/*******************************************************************
+ *Description: Maps a pad file and stores it under its key ID.
+ *Parameters: "id=path"
+ *Returns: 0 on success, -1 after printing why not
+ * ****************************************************************/
+int keystoreAdd(const char *spec);
+
+/*******************************************************************
+ *Description: Looks up a pad by key ID.
+ *Parameters: Key ID, its length (not NUL terminated)
+ *Returns: The pad, NULL if there is none by that ID
+ * ****************************************************************/
+const struct pad* keystoreFind(const char *id, int len);
+
+/*******************************************************************
+ *Description: Opens the key-usage ledger (see ledger.h) for the pads
+ *   added so far. Call once every pad is in.
+ *Parameters: Journal path
+ *Returns: 0 on success, -1 after printing why not
+ * ****************************************************************/
+int keystoreLedger(const char *path);
+
+#endif
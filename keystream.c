@@ -0,0 +1,109 @@
+/*****************************************************************
+*Description: Seeded key generation for keygen. Every block of the
+*   key takes ChaCha20 output (seed as key, block number as nonce,
+*   counter from 0) and maps it to characters by rejection sampling
+*   until the block is full. Blocks depend on nothing but the seed
+*   and their number, so threads can make them in any order.
+* ***************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "keystream.h"
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER(a, b, c, d) \
+   a += b; d ^= a; d = ROTL(d, 16); \
+   c += d; b ^= c; b = ROTL(b, 12); \
+   a += b; d ^= a; d = ROTL(d, 8); \
+   c += d; b ^= c; b = ROTL(b, 7);
+
+static const char alphabet[] = KEY_ALPHABET;
+
+static uint32_t load32(const unsigned char *p) {
+   return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+      (uint32_t)p[3] << 24;
+}
+
+// One 64 byte ChaCha20 block, with a 64 bit nonce and counter
+static void chachaBlock(const uint32_t key[8], uint64_t nonce,
+      uint64_t counter, unsigned char out[64]) {
+   uint32_t in[16] = {
+      0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+      key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+      (uint32_t)counter, (uint32_t)(counter >> 32),
+      (uint32_t)nonce, (uint32_t)(nonce >> 32)
+   };
+   uint32_t x[16];
+   int i;
+
+   memcpy(x, in, sizeof(x));
+   for (i = 0; i < 10; i++) {
+      QUARTER(x[0], x[4], x[8], x[12]);
+      QUARTER(x[1], x[5], x[9], x[13]);
+      QUARTER(x[2], x[6], x[10], x[14]);
+      QUARTER(x[3], x[7], x[11], x[15]);
+      QUARTER(x[0], x[5], x[10], x[15]);
+      QUARTER(x[1], x[6], x[11], x[12]);
+      QUARTER(x[2], x[7], x[8], x[13]);
+      QUARTER(x[3], x[4], x[9], x[14]);
+   }
+
+   for (i = 0; i < 16; i++) {
+      x[i] += in[i];
+      out[4 * i] = x[i];
+      out[4 * i + 1] = x[i] >> 8;
+      out[4 * i + 2] = x[i] >> 16;
+      out[4 * i + 3] = x[i] >> 24;
+   }
+}
+
+// Fills out with block number index of the key
+static void makeBlock(const uint32_t key[8], uint64_t index, char *out) {
+   unsigned char random[64];
+   uint64_t counter = 0;
+   int fill = 0;
+   int i;
+
+   while (fill < KEY_BLOCK) {
+      chachaBlock(key, index, counter++, random);
+      for (i = 0; i < 64 && fill < KEY_BLOCK; i++) {
+	 out[fill] = alphabet[random[i] % 27];
+	 fill += random[i] < KEY_ACCEPT_BELOW;
+      }
+   }
+}
+
+void keystreamRange(const unsigned char seed[KEY_SEED_BYTES],
+      unsigned long start, long len, char *out) {
+   unsigned long index = start / KEY_BLOCK;
+   long skip = start % KEY_BLOCK;
+   char block[KEY_BLOCK];
+   uint32_t key[8];
+   long n;
+   int i;
+
+   for (i = 0; i < 8; i++) {
+      key[i] = load32(seed + 4 * i);
+   }
+
+   while (len > 0) {
+      n = KEY_BLOCK - skip;
+      if (n > len) {
+	 n = len;
+      }
+
+      // Whole blocks go straight to the output
+      if (n == KEY_BLOCK) {
+	 makeBlock(key, index, out);
+      }else{
+	 makeBlock(key, index, block);
+	 memcpy(out, block + skip, n);
+      }
+
+      out += n;
+      len -= n;
+      index++;
+      skip = 0;
+   }
+}
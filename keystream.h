@@ -0,0 +1,27 @@
+/*****************************************************************
+*Description: Seeded key generation for keygen. The key is cut into
+*   blocks of KEY_BLOCK characters and each block is drawn from its
+*   own ChaCha20 stream, keyed by the seed with the block number as
+*   nonce, so any range of the key can be made on its own.
+* ***************************************************************/
+#ifndef KEYSTREAM_H
+#define KEYSTREAM_H
+
+#define KEY_SEED_BYTES 32
+#define KEY_BLOCK 4096
+
+// Key characters, indexed by random byte % 27
+#define KEY_ALPHABET "ABCDEFGHIJKLMNOPQRSTUVWXYZ "
+// Largest multiple of 27 a byte can hold. Bytes from here up are
+// thrown away so every character is equally likely.
+#define KEY_ACCEPT_BELOW 243
+
+/*******************************************************************
+ *Description: Makes characters start to start + len - 1 of the key
+ *   for seed. The same range always gives the same characters.
+ *Parameters: Seed, first character, length, output
+ * ****************************************************************/
+void keystreamRange(const unsigned char seed[KEY_SEED_BYTES],
+      unsigned long start, long len, char *out);
+
+#endif
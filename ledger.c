@@ -0,0 +1,458 @@
+/*****************************************************************
+*Description: Key-usage ledger (see ledger.h). A journal record is
+*   the key ID's length and bytes, the offset and length as 8 bytes
+*   each, and an FNV-1a sum of all that. Records go out in one
+*   O_APPEND write each, so workers appending at once never mix them.
+*   The index lives in memory shared by the workers. Each pad's entry
+*   in it holds a process-shared, robust mutex and a dirty flag, set
+*   while its ranges are being changed: a worker that dies holding the
+*   lock leaves the flag up, and the next to take it rebuilds that
+*   pad's ranges from the journal.
+* ***************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ledger.h"
+#include "keystore.h"
+
+// Bytes of a record around the key ID
+#define RECORD_FIXED (1 + 8 + 8 + 4)
+
+struct ledgerHeader {
+   uint64_t keyCount;
+   uint64_t rangeCap;
+   uint64_t journalSynced;	// Journal bytes known to be on disk
+} __attribute__((aligned(64)));
+
+struct range {
+   uint64_t start;
+   uint64_t end;		// Past the last character
+};
+
+struct ledgerKey {
+   char id[KEY_ID_MAX + 1];
+   pthread_mutex_t lock;
+   uint32_t dirty;
+   uint64_t count;
+   struct range ranges[];	// LEDGER_RANGES, sorted by start
+} __attribute__((aligned(64)));
+
+static struct ledgerHeader *header;
+static size_t stride;
+static int journal = -1;
+
+// The calling worker's sync thread and what it was asked to sync
+static struct {
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+   uint64_t wanted;	// Journal bytes a claim waits on
+   int failed;		// errno of a failed sync, 0 while none has
+   int notify;		// eventfd bumped after each sync
+} syncer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, -1 };
+
+static struct ledgerKey* keyAt(uint64_t i) {
+   return (struct ledgerKey*)((char*)(header + 1) + i * stride);
+}
+
+static uint32_t checksum(const unsigned char *p, long len) {
+   uint32_t sum = 2166136261u;
+
+   while (len-- > 0) {
+      sum = (sum ^ *p++) * 16777619u;
+   }
+   return sum;
+}
+
+// First range of the key ending after at, or count
+static uint64_t firstEndingAfter(struct ledgerKey *key, uint64_t at) {
+   uint64_t lo = 0, hi = key->count, mid;
+
+   while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (key->ranges[mid].end > at) {
+	 hi = mid;
+      }else{
+	 lo = mid + 1;
+      }
+   }
+   return lo;
+}
+
+// First range of the key starting after at, or count
+static uint64_t firstStartingAfter(struct ledgerKey *key, uint64_t at) {
+   uint64_t lo = 0, hi = key->count, mid;
+
+   while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (key->ranges[mid].start > at) {
+	 hi = mid;
+      }else{
+	 lo = mid + 1;
+      }
+   }
+   return lo;
+}
+
+/*******************************************************************
+ *Description: Merges [start, end) into the key's ranges, joining it
+ *   with every range it overlaps or touches.
+ *Parameters: Key, range
+ *Returns: 0, or -1 if it needs a range of its own and there is no
+ *   room
+ * ****************************************************************/
+static int addRange(struct ledgerKey *key, uint64_t start, uint64_t end) {
+   uint64_t lo = start > 0 ? firstEndingAfter(key, start - 1) : 0;
+   uint64_t hi = firstStartingAfter(key, end);
+   struct range *r = key->ranges;
+
+   if (lo == hi) {
+      if (key->count == header->rangeCap) {
+	 return -1;
+      }
+      memmove(r + lo + 1, r + lo, (key->count - lo) * sizeof(*r));
+      r[lo].start = start;
+      r[lo].end = end;
+      key->count++;
+      return 0;
+   }
+
+   if (start < r[lo].start) {
+      r[lo].start = start;
+   }
+   r[lo].end = end > r[hi - 1].end ? end : r[hi - 1].end;
+   memmove(r + lo + 1, r + hi, (key->count - hi) * sizeof(*r));
+   key->count -= hi - lo - 1;
+   return 0;
+}
+
+static struct ledgerKey* findKey(const char *id, int len) {
+   struct ledgerKey *key;
+   uint64_t i;
+
+   for (i = 0; i < header->keyCount; i++) {
+      key = keyAt(i);
+      if (strlen(key->id) == (size_t)len && memcmp(key->id, id, len) == 0) {
+	 return key;
+      }
+   }
+   return NULL;
+}
+
+/*******************************************************************
+ *Description: Merges the journal records from byte from on into the
+ *   index, those of one key or of all. Records of pads the daemon
+ *   does not hold are skipped.
+ *Parameters: Start, key or NULL for all
+ *Returns: End of the last whole record, or -1 after printing why if
+ *   the journal is damaged before its end
+ * ****************************************************************/
+static long replay(long from, struct ledgerKey *only) {
+   const unsigned char *data, *rec;
+   struct ledgerKey *key;
+   uint64_t offset, len;
+   uint32_t sum;
+   struct stat st;
+   long at = from;
+   int idLen;
+
+   if (fstat(journal, &st) < 0) {
+      perror("SERVER: key ledger journal");
+      return -1;
+   }
+   if (st.st_size <= from) {
+      return from;
+   }
+   data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, journal, 0);
+   if (data == MAP_FAILED) {
+      perror("SERVER: key ledger journal");
+      return -1;
+   }
+
+   while (at < st.st_size) {
+      rec = data + at;
+      idLen = rec[0];
+      // A record cut short by a crash can only be the last
+      if (st.st_size - at < RECORD_FIXED + idLen) {
+	 break;
+      }
+      memcpy(&offset, rec + 1 + idLen, 8);
+      memcpy(&len, rec + 1 + idLen + 8, 8);
+      memcpy(&sum, rec + 1 + idLen + 16, 4);
+      if (idLen == 0 || sum != checksum(rec, 1 + idLen + 16) ||
+	    offset + len < offset) {
+	 fprintf(stderr, "SERVER: key ledger journal is damaged at byte %ld\n",
+	       at);
+	 munmap((void*)data, st.st_size);
+	 return -1;
+      }
+
+      key = findKey((const char*)rec + 1, idLen);
+      if (key != NULL && (only == NULL || key == only) &&
+	    addRange(key, offset, offset + len) < 0) {
+	 fprintf(stderr, "SERVER: key ledger of %s is full\n", key->id);
+	 munmap((void*)data, st.st_size);
+	 return -1;
+      }
+      at += RECORD_FIXED + idLen;
+   }
+
+   munmap((void*)data, st.st_size);
+   return at;
+}
+
+// Takes the key's lock, first repairing what a dead holder left
+static int lockKey(struct ledgerKey *key) {
+   int rc = pthread_mutex_lock(&key->lock);
+
+   if (rc == EOWNERDEAD) {
+      if (__atomic_load_n(&key->dirty, __ATOMIC_ACQUIRE)) {
+	 key->count = 0;
+	 if (replay(0, key) < 0) {
+	    pthread_mutex_unlock(&key->lock);
+	    return -1;
+	 }
+	 __atomic_store_n(&key->dirty, 0, __ATOMIC_RELEASE);
+      }
+      pthread_mutex_consistent(&key->lock);
+      rc = 0;
+   }
+   return rc == 0 ? 0 : -1;
+}
+
+// Appends a claim to the journal in one write, setting end to where
+// the journal ended after it
+static int appendRecord(struct ledgerKey *key, uint64_t offset, uint64_t len,
+      uint64_t *end) {
+   off_t at;
+   unsigned char rec[RECORD_FIXED + KEY_ID_MAX];
+   int idLen = strlen(key->id);
+   int size = RECORD_FIXED + idLen;
+   uint32_t sum;
+   ssize_t n;
+
+   rec[0] = idLen;
+   memcpy(rec + 1, key->id, idLen);
+   memcpy(rec + 1 + idLen, &offset, 8);
+   memcpy(rec + 1 + idLen + 8, &len, 8);
+   sum = checksum(rec, 1 + idLen + 16);
+   memcpy(rec + 1 + idLen + 16, &sum, 4);
+
+   do {
+      n = write(journal, rec, size);
+   } while (n < 0 && errno == EINTR);
+   if (n != size) {
+      if (n >= 0) {
+	 errno = EIO;
+      }
+      return -1;
+   }
+   // The offset is shared by all workers, so it may be past this
+   // record, never before it
+   at = lseek(journal, 0, SEEK_CUR);
+   if (at < 0) {
+      return -1;
+   }
+   *end = at;
+   return 0;
+}
+
+/*******************************************************************
+ *Description: Body of a worker's sync thread. Each fdatasync covers
+ *   every record in the journal when it starts, so the claims made
+ *   while one runs are all made durable by the next. A failed sync
+ *   is not retried: what it lost cannot be told from what it kept.
+ * ****************************************************************/
+static void* syncLoop(void *arg) {
+   uint64_t synced, one = 1;
+   struct stat st;
+
+   (void)arg;
+   while (1) {
+      pthread_mutex_lock(&syncer.lock);
+      while (syncer.wanted <=
+	    __atomic_load_n(&header->journalSynced, __ATOMIC_ACQUIRE)) {
+	 pthread_cond_wait(&syncer.wake, &syncer.lock);
+      }
+      pthread_mutex_unlock(&syncer.lock);
+
+      if (fstat(journal, &st) < 0 || fdatasync(journal) < 0) {
+	 __atomic_store_n(&syncer.failed, errno, __ATOMIC_RELEASE);
+	 write(syncer.notify, &one, sizeof(one));
+	 return NULL;
+      }
+      // Raised for the other workers too, whose claims it covered
+      synced = __atomic_load_n(&header->journalSynced, __ATOMIC_ACQUIRE);
+      while (synced < (uint64_t)st.st_size &&
+	    !__atomic_compare_exchange_n(&header->journalSynced, &synced,
+	       st.st_size, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+      }
+      write(syncer.notify, &one, sizeof(one));
+   }
+   return NULL;
+}
+
+int ledgerSyncStart(void) {
+   pthread_t id;
+
+   syncer.notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (syncer.notify < 0) {
+      return -1;
+   }
+   errno = pthread_create(&id, NULL, syncLoop, NULL);
+   if (errno != 0) {
+      close(syncer.notify);
+      return -1;
+   }
+   pthread_detach(id);
+   return syncer.notify;
+}
+
+void ledgerSyncWant(uint64_t mark) {
+   pthread_mutex_lock(&syncer.lock);
+   if (mark > syncer.wanted) {
+      syncer.wanted = mark;
+      pthread_cond_signal(&syncer.wake);
+   }
+   pthread_mutex_unlock(&syncer.lock);
+}
+
+int ledgerSynced(uint64_t mark) {
+   int failed;
+
+   if (__atomic_load_n(&header->journalSynced, __ATOMIC_ACQUIRE) >= mark) {
+      return 1;
+   }
+   failed = __atomic_load_n(&syncer.failed, __ATOMIC_ACQUIRE);
+   if (failed != 0) {
+      errno = failed;
+      return -1;
+   }
+   return 0;
+}
+
+int ledgerClaim(struct ledgerKey *key, uint64_t offset, uint64_t len,
+      uint64_t *mark) {
+   uint64_t i;
+   int rc = 0;
+
+   *mark = 0;
+   if (len == 0) {
+      return 0;
+   }
+   if (offset + len < offset) {
+      errno = EINVAL;
+      return -1;
+   }
+   if (lockKey(key) < 0) {
+      errno = EIO;
+      return -1;
+   }
+
+   i = firstEndingAfter(key, offset);
+   if (i < key->count && key->ranges[i].start < offset + len) {
+      errno = EEXIST;
+      rc = -1;
+   }else if (key->count == header->rangeCap &&
+	 (i == key->count || key->ranges[i].start > offset + len) &&
+	 (i == 0 || key->ranges[i - 1].end < offset)) {
+      // Touching neither neighbour, it would need a range of its own
+      errno = ENOSPC;
+      rc = -1;
+   }else{
+      // Journaled first, so a worker dying from here on leaves the
+      // index dirty and the claim on record
+      __atomic_store_n(&key->dirty, 1, __ATOMIC_RELEASE);
+      rc = appendRecord(key, offset, len, mark);
+      if (rc == 0) {
+	 addRange(key, offset, offset + len);
+      }
+      __atomic_store_n(&key->dirty, 0, __ATOMIC_RELEASE);
+   }
+
+   pthread_mutex_unlock(&key->lock);
+   return rc;
+}
+
+int ledgerCovered(struct ledgerKey *key, uint64_t offset, uint64_t len) {
+   uint64_t i;
+   int covered;
+
+   if (len == 0) {
+      return 1;
+   }
+   if (offset + len < offset) {
+      return 0;
+   }
+   if (lockKey(key) < 0) {
+      errno = EIO;
+      return -1;
+   }
+   // Touching ranges are merged, so a covered range lies in one
+   i = firstEndingAfter(key, offset);
+   covered = i < key->count && key->ranges[i].start <= offset &&
+      key->ranges[i].end >= offset + len;
+   pthread_mutex_unlock(&key->lock);
+   return covered;
+}
+
+int ledgerOpen(const char *path, char **ids, int count,
+      struct ledgerKey **keys) {
+   pthread_mutexattr_t attr;
+   size_t size;
+   long end;
+   int i;
+
+   stride = (sizeof(struct ledgerKey) + LEDGER_RANGES * sizeof(struct range) +
+	 63) / 64 * 64;
+   size = sizeof(struct ledgerHeader) + count * stride;
+
+   journal = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+   if (journal < 0) {
+      perror(path);
+      return -1;
+   }
+   // Shared but not backed by a file: pages of an index written back
+   // in no particular order could not be trusted after a power loss
+   header = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (header == MAP_FAILED) {
+      perror("SERVER: key ledger index");
+      return -1;
+   }
+   header->keyCount = count;
+   header->rangeCap = LEDGER_RANGES;
+   for (i = 0; i < count; i++) {
+      strcpy(keyAt(i)->id, ids[i]);
+   }
+
+   end = replay(0, NULL);
+   if (end < 0) {
+      return -1;
+   }
+   // Drop a record cut short by a crash, so the next lands after a
+   // whole one. Records an earlier daemon wrote but never synced were
+   // replayed all the same, so they are made to stay.
+   if (ftruncate(journal, end) < 0 || fdatasync(journal) < 0) {
+      perror(path);
+      return -1;
+   }
+   header->journalSynced = end;
+
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+   pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+   for (i = 0; i < count; i++) {
+      pthread_mutex_init(&keyAt(i)->lock, &attr);
+      keys[i] = keyAt(i);
+   }
+   pthread_mutexattr_destroy(&attr);
+   return 0;
+}
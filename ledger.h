@@ -0,0 +1,71 @@
+/*****************************************************************
+*Description: Key-usage ledger of the daemons, so that no range of a
+*   pad encrypts twice. Every range claimed is appended to a journal
+*   file, the record of what was used, and merged into an index in
+*   memory the workers share. The index keeps each pad's used ranges
+*   sorted and coalesced, so a claim is checked with a binary search
+*   under a lock of that pad alone. It is only a cache of the journal,
+*   built again from the whole of it at every start up.
+* ***************************************************************/
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include <stdint.h>
+
+// Ranges kept per pad; touching ranges merge, so pads used in order
+// take one
+#define LEDGER_RANGES 65536
+
+struct ledgerKey;
+
+/*******************************************************************
+ *Description: Opens the journal and builds the index from it. Call
+ *   before the workers are forked.
+ *Parameters: Journal path, key IDs of the pads, pad count, set to
+ *   each pad's entry
+ *Returns: 0, or -1 after printing why not
+ * ****************************************************************/
+int ledgerOpen(const char *path, char **ids, int count,
+      struct ledgerKey **keys);
+
+/*******************************************************************
+ *Description: Claims len characters of a pad from offset on, unless
+ *   any of them were claimed before. The claim is in the journal when
+ *   this returns, but outlives a crash of the host only once
+ *   ledgerSynced() says the journal is on disk up to its mark; until
+ *   then nothing ciphered with the range may leave the daemon.
+ *Parameters: The pad's entry, offset, length, set to the claim's mark
+ *Returns: 0, or -1 with errno EEXIST if the range overlaps one in use,
+ *   ENOSPC if the pad has no room for another range, or that of the
+ *   failed journal write
+ * ****************************************************************/
+int ledgerClaim(struct ledgerKey *key, uint64_t offset, uint64_t len,
+      uint64_t *mark);
+
+/*******************************************************************
+ *Description: Checks that all len characters of a pad from offset on
+ *   were claimed before, as they must be to decrypt with them. Claims
+ *   nothing.
+ *Parameters: The pad's entry, offset, length
+ *Returns: 1 if they were, 0 if not, or -1 with errno EIO if the pad's
+ *   entry could not be locked
+ * ****************************************************************/
+int ledgerCovered(struct ledgerKey *key, uint64_t offset, uint64_t len);
+
+/*******************************************************************
+ *Description: Starts the calling worker's sync thread, which group
+ *   commits the journal: one fdatasync at a time covers all the
+ *   claims made before it began, by any worker. Call once per worker,
+ *   with the signals the thread must not take blocked.
+ *Returns: An eventfd readable after each sync, or -1 with errno set
+ * ****************************************************************/
+int ledgerSyncStart(void);
+
+// Asks the sync thread to make the journal durable up to mark
+void ledgerSyncWant(uint64_t mark);
+
+// Returns 1 if the journal is on disk up to mark, 0 if not yet, or -1
+// with errno set once a sync has failed and it never will be
+int ledgerSynced(uint64_t mark);
+
+#endif
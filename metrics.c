@@ -0,0 +1,233 @@
+/*****************************************************************
+*Description: Daemon metrics (see metrics.h). The slots are mapped
+*   shared and anonymous before the worker pool is forked, and the
+*   endpoint runs as a thread of the daemon's first process, which
+*   outlives any worker.
+* ***************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+
+// Largest scrape, with room to spare
+#define STATS_PAGE (32 << 10)
+// How long a scraper gets to send its request
+#define REQUEST_WAIT 200
+// How long to wait before accepting again after accept fails
+#define ACCEPT_BACKOFF 100
+
+// Counts made before a slot is taken go nowhere
+static struct workerMetrics unused;
+struct workerMetrics *metrics = &unused;
+
+static struct workerMetrics *slots;
+static int slotCount;
+static int statsSocket;
+
+static const char *phaseNames[PHASES] = {"read", "cipher", "write"};
+
+int metricsInit(int workers) {
+   slotCount = workers > 0 ? workers : 1;
+   slots = mmap(NULL, slotCount * sizeof(struct workerMetrics),
+	 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (slots == MAP_FAILED) {
+      slots = NULL;
+      return -1;
+   }
+   return 0;
+}
+
+void metricsUse(int slot) {
+   metrics = &slots[slot];
+   metricsAdd(&metrics->closed, metrics->accepted - metrics->closed);
+}
+
+// Loads a counter summed over the slots
+static uint64_t total(const uint64_t *counter) {
+   size_t offset = (const char*)counter - (const char*)&slots[0];
+   uint64_t sum = 0;
+   int i;
+
+   for (i = 0; i < slotCount; i++) {
+      sum += __atomic_load_n((const uint64_t*)((const char*)&slots[i] +
+	       offset), __ATOMIC_RELAXED);
+   }
+   return sum;
+}
+
+// Appends to the page, dropping what does not fit
+static void put(char *page, int *len, const char *fmt, ...)
+      __attribute__((format(printf, 3, 4)));
+
+static void put(char *page, int *len, const char *fmt, ...) {
+   va_list ap;
+   int n;
+
+   va_start(ap, fmt);
+   n = vsnprintf(page + *len, STATS_PAGE - *len, fmt, ap);
+   va_end(ap);
+   if (n > 0) {
+      *len = *len + n < STATS_PAGE ? *len + n : STATS_PAGE - 1;
+   }
+}
+
+static void putCounter(char *page, int *len, const char *name,
+      const char *type, const char *help, uint64_t value) {
+   put(page, len, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name,
+	 type, name, (unsigned long)value);
+}
+
+// The slots in the Prometheus text format
+static int render(char *page) {
+   struct workerMetrics *s = &slots[0];
+   uint64_t count, cumulative;
+   int len = 0, p, b;
+
+   putCounter(page, &len, "otp_connections_accepted_total", "counter",
+	 "Connections accepted.", total(&s->accepted));
+   putCounter(page, &len, "otp_connections_open", "gauge",
+	 "Connections open.", total(&s->accepted) - total(&s->closed));
+   putCounter(page, &len, "otp_received_bytes_total", "counter",
+	 "Bytes read from clients.", total(&s->bytesIn));
+   putCounter(page, &len, "otp_sent_bytes_total", "counter",
+	 "Bytes written to clients.", total(&s->bytesOut));
+   putCounter(page, &len, "otp_handshake_rejections_total", "counter",
+	 "Clients of a type the daemon does not serve.", total(&s->rejected));
+   putCounter(page, &len, "otp_job_errors_total", "counter",
+	 "Jobs answered with an error frame.", total(&s->errors));
+
+   put(page, &len, "# HELP otp_jobs_total Jobs completed.\n"
+	 "# TYPE otp_jobs_total counter\n"
+	 "otp_jobs_total{type=\"encrypt\"} %lu\n"
+	 "otp_jobs_total{type=\"decrypt\"} %lu\n",
+	 (unsigned long)total(&s->jobs[0]), (unsigned long)total(&s->jobs[1]));
+
+   put(page, &len, "# HELP otp_phase_seconds Time spent per phase of a "
+	 "job.\n# TYPE otp_phase_seconds histogram\n");
+   for (p = 0; p < PHASES; p++) {
+      cumulative = 0;
+      for (b = 0; b < METRICS_BUCKETS; b++) {
+	 cumulative += total(&s->phaseCount[p][b]);
+	 if (b < METRICS_BUCKETS - 1) {
+	    put(page, &len, "otp_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} "
+		  "%lu\n", phaseNames[p], (double)(1L << b) / 1e6,
+		  (unsigned long)cumulative);
+	 }
+      }
+      count = cumulative;
+      put(page, &len, "otp_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n"
+	    "otp_phase_seconds_sum{phase=\"%s\"} %.9f\n"
+	    "otp_phase_seconds_count{phase=\"%s\"} %lu\n",
+	    phaseNames[p], (unsigned long)count, phaseNames[p],
+	    total(&s->phaseSum[p]) / 1e9, phaseNames[p], (unsigned long)count);
+   }
+   return len;
+}
+
+// Writes it all, giving up on a scraper that goes away
+static void sendAll(int sock, const char *buf, int len) {
+   int n;
+
+   while (len > 0) {
+      n = write(sock, buf, len);
+      if (n < 0 && errno == EINTR) {
+	 continue;
+      }
+      if (n <= 0) {
+	 return;
+      }
+      buf += n;
+      len -= n;
+   }
+}
+
+/*******************************************************************
+ *Description: Answers scrapes one at a time. A request starting with
+ *   GET gets an HTTP response, anything else, or nothing within
+ *   REQUEST_WAIT milliseconds, gets the bare page. An accept that
+ *   fails for lack of descriptors backs off ACCEPT_BACKOFF ms.
+ * ****************************************************************/
+static void* serveStats(void *arg) {
+   static char page[STATS_PAGE];
+   char request[1024], header[128];
+   struct pollfd pfd;
+   int sock, len, n;
+
+   while (1) {
+      sock = accept(statsSocket, NULL, NULL);
+      if (sock < 0) {
+	 if (errno != EINTR && errno != ECONNABORTED) {
+	    // Out of descriptors or memory: the scrape can wait
+	    poll(NULL, 0, ACCEPT_BACKOFF);
+	 }
+	 continue;
+      }
+
+      pfd.fd = sock;
+      pfd.events = POLLIN;
+      n = 0;
+      if (poll(&pfd, 1, REQUEST_WAIT) > 0) {
+	 n = read(sock, request, sizeof(request));
+      }
+
+      len = render(page);
+      if (n >= 4 && memcmp(request, "GET ", 4) == 0) {
+	 n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+	       "Content-Type: text/plain; version=0.0.4\r\n"
+	       "Content-Length: %d\r\n\r\n", len);
+	 sendAll(sock, header, n);
+      }
+      sendAll(sock, page, len);
+      close(sock);
+   }
+   return NULL;
+}
+
+int metricsServe(int port) {
+   struct sockaddr_in address;
+   sigset_t all, old;
+   pthread_t thread;
+   int one = 1;
+   int rc;
+
+   statsSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (statsSocket < 0) {
+      return -1;
+   }
+   setsockopt(statsSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+   // Only this host can read the stats
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_port = htons(port);
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(statsSocket, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+	 listen(statsSocket, 16) < 0) {
+      close(statsSocket);
+      return -1;
+   }
+
+   // Signals stay with the thread that handles them
+   sigfillset(&all);
+   pthread_sigmask(SIG_SETMASK, &all, &old);
+   rc = pthread_create(&thread, NULL, serveStats, NULL);
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+   if (rc != 0) {
+      close(statsSocket);
+      errno = rc;
+      return -1;
+   }
+   pthread_detach(thread);
+   return 0;
+}
@@ -0,0 +1,91 @@
+/*****************************************************************
+*Description: Counters and latency histograms of the daemons, and
+*   the endpoint that serves them in the Prometheus text format.
+*   Every worker owns one slot of a shared mapping and is the only
+*   writer of it, so counting is a plain add with no lock or atomic
+*   read-modify-write. The endpoint sums the slots as it reads them.
+* ***************************************************************/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Latency buckets, the first ends at 1us and each doubles the last;
+// the final one is open ended
+#define METRICS_BUCKETS 22
+
+enum metricsPhase {
+   PHASE_READ,		// A framed chunk arriving, first byte to last
+   PHASE_CIPHER,	// Ciphering a chunk or message
+   PHASE_WRITE,		// A reply queued until it is all sent
+   PHASES
+};
+
+struct workerMetrics {
+   uint64_t accepted;
+   uint64_t closed;
+   uint64_t bytesIn;
+   uint64_t bytesOut;
+   uint64_t jobs[2];		// By cipherDirection
+   uint64_t rejected;		// Handshakes of a type not served
+   uint64_t errors;		// Jobs answered with an error frame
+   uint64_t phaseCount[PHASES][METRICS_BUCKETS];
+   uint64_t phaseSum[PHASES];	// Nanoseconds
+} __attribute__((aligned(64)));
+
+// This worker's slot
+extern struct workerMetrics *metrics;
+
+// Adds to a counter of this worker's slot. The store is atomic so the
+// endpoint never reads half of it.
+static inline void metricsAdd(uint64_t *counter, uint64_t n) {
+   __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+	 __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metricsNow(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Records a phase that began at start, a metricsNow() time
+static inline void metricsTime(enum metricsPhase phase, uint64_t start) {
+   uint64_t ns = metricsNow() - start;
+   // The first bucket whose bound, 2^b microseconds, is not below it
+   int b = ns <= 1000 ? 0 : 64 - __builtin_clzll((ns - 1) / 1000);
+
+   if (b > METRICS_BUCKETS - 1) {
+      b = METRICS_BUCKETS - 1;
+   }
+   metricsAdd(&metrics->phaseCount[phase][b], 1);
+   metricsAdd(&metrics->phaseSum[phase], ns);
+}
+
+/*******************************************************************
+ *Description: Maps the slots, shared with the workers forked later.
+ *Parameters: Worker count
+ *Returns: 0, or -1 with errno set
+ * ****************************************************************/
+int metricsInit(int workers);
+
+/*******************************************************************
+ *Description: Makes a slot this process's. A worker replacing one
+ *   that died keeps its counts, less the connections that died with
+ *   it.
+ *Parameters: Slot index
+ * ****************************************************************/
+void metricsUse(int slot);
+
+/*******************************************************************
+ *Description: Listens on 127.0.0.1:port and starts a thread that
+ *   answers each connection, HTTP scrape or not, with the summed
+ *   slots in the Prometheus text format.
+ *Parameters: Port
+ *Returns: 0, or -1 with errno set
+ * ****************************************************************/
+int metricsServe(int port);
+
+#endif
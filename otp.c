@@ -0,0 +1,205 @@
+/****************************************************************
+ * Description: Ciphers a file with a key file on this host, without
+ *    a daemon.
+ *    USAGE: otp [-d] [-t threads] [-f offset] [-v] text key output
+ *    The text and key are mapped, the output file is sized up front
+ *    and mapped too, and cipherApply() writes the result straight
+ *    into it, split over -t threads (one per online CPU by default).
+ *    As with the clients, the text ends at EOF or its first \n and
+ *    the result is followed by \n. -d decrypts, -f takes the key from
+ *    that character on, and -v reports the throughput on stderr to
+ *    compare with the daemons.
+ * *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cipher.h"
+
+// Characters checked and ciphered per step, so the text is still in
+// cache when the cipher reads it after the check
+#define BLOCK (8L << 20)
+
+// A file mapped for reading
+struct input {
+   char *data;		// NULL if the file is empty
+   long len;
+   dev_t dev;
+   ino_t ino;
+};
+
+// Error function used for reporting issues
+static void error(const char *msg) {
+   perror(msg);
+   exit(1);
+}
+
+static void mapInput(const char *file, struct input *in) {
+   int fd = open(file, O_RDONLY);
+   struct stat st;
+
+   if (fd < 0 || fstat(fd, &st) < 0) {
+      error(file);
+   }
+   if (!S_ISREG(st.st_mode)) {
+      fprintf(stderr, "otp: %s is not a regular file\n", file);
+      exit(1);
+   }
+
+   in->len = st.st_size;
+   in->dev = st.st_dev;
+   in->ino = st.st_ino;
+   in->data = NULL;
+   if (in->len > 0) {
+      in->data = mmap(NULL, in->len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (in->data == MAP_FAILED) {
+	 error(file);
+      }
+      madvise(in->data, in->len, MADV_SEQUENTIAL);
+   }
+   close(fd);
+}
+
+// Whether fd is the file the input was mapped from
+static int isFile(int fd, struct input *in) {
+   struct stat st;
+
+   return fstat(fd, &st) == 0 && st.st_dev == in->dev && st.st_ino == in->ino;
+}
+
+/****************************************************************
+ * Description: Checks and ciphers the text a block at a time until
+ *    its end or first \n. Exits on a character outside the alphabet
+ *    or a key too short for the text.
+ * Parameters: Direction, text, key, first key character, output
+ * Returns: Characters ciphered
+ * **************************************************************/
+static long cipherFile(enum cipherDirection dir, struct input *text,
+      struct input *key, long offset, char *out) {
+   long keyLen = key->len > offset ? key->len - offset : 0;
+   const char *keyData = key->data + (keyLen > 0 ? offset : 0);
+   long done = 0;
+   long n, good, keyGood;
+
+   while (done < text->len) {
+      n = text->len - done < BLOCK ? text->len - done : BLOCK;
+      good = cipherCheck(text->data + done, n);
+      if (good < n && text->data[done + good] != '\n') {
+	 fprintf(stderr, "Bad character input.\n");
+	 exit(1);
+      }
+
+      // The key ends at its first \n as well
+      keyGood = keyLen - done < good ? keyLen - done : good;
+      keyGood = cipherCheck(keyData + done, keyGood);
+      if (keyGood < good) {
+	 if (done + keyGood < keyLen && keyData[done + keyGood] != '\n') {
+	    fprintf(stderr, "Bad character input.\n");
+	 }else{
+	    fprintf(stderr, "Key is shorter than %s.\n",
+		  dir == CIPHER_ENCRYPT ? "plaintext" : "cyphertext");
+	 }
+	 exit(1);
+      }
+
+      cipherApply(dir, out + done, text->data + done, keyData + done, good);
+      done += good;
+      if (good < n) {
+	 break;
+      }
+   }
+   return done;
+}
+
+static void usage(void) {
+   fprintf(stderr, "USAGE: otp [-d] [-t threads] [-f offset] [-v] "
+	 "text key output\n");
+   exit(1);
+}
+
+int main(int argc, char *argv[]) {
+   enum cipherDirection dir = CIPHER_ENCRYPT;
+   int threads = sysconf(_SC_NPROCESSORS_ONLN);
+   struct input text, key;
+   struct timespec start, end;
+   double seconds;
+   long offset = 0;
+   int verbose = 0;
+   char *out;
+   long len;
+   int fd, opt;
+
+   while ((opt = getopt(argc, argv, "dt:f:v")) != -1) {
+      switch (opt) {
+	 case 'd':
+	    dir = CIPHER_DECRYPT;
+	    break;
+	 case 't':
+	    threads = atoi(optarg);
+	    break;
+	 case 'f':
+	    offset = atol(optarg);
+	    break;
+	 case 'v':
+	    verbose = 1;
+	    break;
+	 default:
+	    usage();
+      }
+   }
+   if (argc - optind != 3 || threads < 1 || offset < 0) {
+      usage();
+   }
+
+   mapInput(argv[optind], &text);
+   mapInput(argv[optind + 1], &key);
+
+   fd = open(argv[optind + 2], O_RDWR | O_CREAT, 0644);
+   if (fd < 0) {
+      error(argv[optind + 2]);
+   }
+   // Truncating an input would pull the pages out from under its map
+   if (isFile(fd, &text) || isFile(fd, &key)) {
+      fprintf(stderr, "otp: output must not be an input\n");
+      exit(1);
+   }
+
+   // Sized for the whole text and trimmed once its end is known
+   if (ftruncate(fd, 0) < 0 || ftruncate(fd, text.len + 1) < 0) {
+      error("otp: ftruncate");
+   }
+   posix_fallocate(fd, 0, text.len + 1);
+   out = mmap(NULL, text.len + 1, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (out == MAP_FAILED) {
+      error("otp: mmap");
+   }
+
+   if (threads > 1 && cipherStartThreads(threads) < 0) {
+      error("otp: starting cipher threads");
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   len = cipherFile(dir, &text, &key, offset, out);
+   out[len] = '\n';
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   munmap(out, text.len + 1);
+   if (ftruncate(fd, len + 1) < 0 || close(fd) < 0) {
+      error("otp: Could not write output file");
+   }
+
+   if (verbose) {
+      seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+      fprintf(stderr, "otp: %ld characters in %.3f s, %.1f MB/s, %d threads\n",
+	    len, seconds, seconds > 0 ? len / seconds / 1e6 : 0.0, threads);
+   }
+   return 0;
+}
@@ -0,0 +1,11 @@
+/*****************************************************************
+*Description: Daemon serving both enc_client and dec_client on one
+*   port, each connection ciphered in the direction its handshake
+*   asks for
+* ***************************************************************/
+
+#include "server.h"
+
+int main(int argc, char *argv[]){
+   return runServer(argc, argv, "ed");
+}
@@ -0,0 +1,862 @@
+/*******************************************************************
+ * Description: libotpclient (see otpclient.h). Every connection
+ *    keeps a ring of the requests it has in flight, oldest first,
+ *    since the daemon answers them in order. Requests follow each
+ *    other without waiting for results, and each is cut into chunks
+ *    that go out while earlier results are still coming back, so
+ *    neither side holds more than a chunk of one at a time. The
+ *    sockets are non-blocking and watched by one edge triggered
+ *    epoll set, so they are always read and written until they
+ *    would block.
+ *    Shared memory is handed out as a ring: blocks are taken at the
+ *    head and given back at the tail, and one freed out of order is
+ *    only reclaimed once those before it are.
+ * ****************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY
+
+#include "otpclient.h"
+#include "protocol.h"
+#include "keystore.h"
+
+#define MAX_EVENTS 64
+// Shared blocks start on this boundary
+#define SHARE_ALIGN 64
+
+// Pieces of an outgoing frame, in the order they are sent
+enum {
+   PIECE_HANDSHAKE,	// Before the first frame of a connection
+   PIECE_PAD,		// Pad reference before the first chunk of a request
+   PIECE_HEADER,
+   PIECE_TEXT,
+   PIECE_KEY,
+   PIECE_END,		// End frame after the last chunk of a request
+   PIECES
+};
+
+// Frame being written, as the part of each piece still unsent.
+// Handshake, pad reference and end frame ride along with a chunk so
+// small messages leave in one packet. Pieces with a file behind them
+// go out with sendfile() from that file.
+struct outFrame {
+   char handshake;
+   int passFd;		// Shared memory sent along with the handshake, or -1
+   char pad[FRAME_HEADER + PAD_OFFSET + KEY_ID_MAX];
+   char header[FRAME_HEADER + SHARED_FRAME];	// A FRAME_SHARED fits
+   char end[FRAME_HEADER];
+   struct iovec iov[PIECES];
+   int fd[PIECES];
+   off_t offset[PIECES];
+   int part;		// First piece not fully sent
+   int last;
+};
+
+// A connection to the daemon and the requests it has in flight
+struct session {
+   int sock;		// -1 while closed
+   int connecting;	// connect() not finished yet
+   int greeted;		// Handshake sent
+   int accepted;	// Handshake reply seen
+   char *in;		// Result bytes not yet taken
+   int inLen;
+   struct outFrame frame;
+   int framing;		// frame holds unsent pieces
+   long queued;		// Text of the request being sent already framed
+   struct otpRequest *jobs[OTP_WINDOW];
+   int first;
+   int count;
+   int sent;		// Requests in the ring fully sent
+};
+
+// A singly linked queue of requests
+struct queue {
+   struct otpRequest *head;
+   struct otpRequest *tail;
+   int len;
+};
+
+// Header of a block of shared memory
+struct shareBlock {
+   long size;		// Bytes to the next block, this header included
+   long free;		// Given back, or never handed out
+};
+
+struct otpClient {
+   struct sockaddr_storage addr;
+   socklen_t addrLen;
+   char type;		// Handshake byte of the daemon
+   int epoll;
+   struct session *sessions;
+   int conns;
+   struct queue waiting;	// Submitted, not yet on a connection
+   struct queue done;		// Finished, not yet completed
+   int outstanding;
+   // Memory shared with the daemon, or NULL, and its ring of blocks
+   char *shared;
+   long sharedLen;
+   int sharedFd;
+   long head, tail, used;
+};
+
+static void push(struct queue *q, struct otpRequest *req) {
+   req->next = NULL;
+   if (q->tail != NULL) {
+      q->tail->next = req;
+   }else{
+      q->head = req;
+   }
+   q->tail = req;
+   q->len++;
+}
+
+static struct otpRequest* pop(struct queue *q) {
+   struct otpRequest *req = q->head;
+
+   if (req != NULL) {
+      q->head = req->next;
+      if (q->head == NULL) {
+	 q->tail = NULL;
+      }
+      q->len--;
+   }
+   return req;
+}
+
+static void finish(struct otpClient *client, struct otpRequest *req,
+      enum otpStatus status, const char *msg, int msgLen) {
+   req->status = status;
+   snprintf(req->error, sizeof(req->error), "%.*s", msgLen, msg);
+   push(&client->done, req);
+}
+
+// Fails every request in flight on the session and closes it
+static void failSession(struct otpClient *client, struct session *s,
+      enum otpStatus status, const char *msg) {
+   while (s->count > 0) {
+      finish(client, s->jobs[s->first], status, msg, strlen(msg));
+      s->first = (s->first + 1) % OTP_WINDOW;
+      s->count--;
+   }
+   close(s->sock);
+   s->sock = -1;
+}
+
+/****************************************************************
+ * Description: Starts connecting the session and adds it to the
+ *    epoll set. The connect finishes in the background, the socket
+ *    turning writable when it has (see finishConnect()).
+ * Parameters: Client, session
+ * Returns: 0, or -1 with errno set if the connect failed at once
+ * **************************************************************/
+static int openSession(struct otpClient *client, struct session *s) {
+   struct epoll_event ev;
+   int one = 1;
+
+   s->sock = socket(client->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+   if (s->sock < 0) {
+      return -1;
+   }
+   s->connecting = 0;
+   if (connect(s->sock, (struct sockaddr*)&client->addr, client->addrLen) < 0) {
+      if (errno != EINPROGRESS) {
+	 close(s->sock);
+	 s->sock = -1;
+	 return -1;
+      }
+      s->connecting = 1;
+   }
+   // Frames are written whole, Nagle would only hold the last one back
+   if (client->addr.ss_family == AF_INET) {
+      setsockopt(s->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   }
+
+   ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+   ev.data.ptr = s;
+   epoll_ctl(client->epoll, EPOLL_CTL_ADD, s->sock, &ev);
+
+   s->greeted = 0;
+   s->accepted = 0;
+   s->inLen = 0;
+   s->framing = 0;
+   s->queued = 0;
+   s->first = 0;
+   s->count = 0;
+   s->sent = 0;
+   return 0;
+}
+
+// Takes the outcome of the session's connect once the socket is
+// writable. Returns 0, or -1 if it failed and the session with it.
+static int finishConnect(struct otpClient *client, struct session *s) {
+   socklen_t len = sizeof(int);
+   int err;
+
+   if (getsockopt(s->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+      err = errno;
+   }
+   if (err != 0) {
+      failSession(client, s, OTP_FAILED, strerror(err));
+      errno = err;
+      return -1;
+   }
+   s->connecting = 0;
+   return 0;
+}
+
+/****************************************************************
+ * Description: Sets up the next chunk of text with the matching
+ *    key. The first chunk of a pad request carries the pad reference
+ *    in front, which replaces the key, and the last chunk carries
+ *    the end frame behind it. A request in shared memory goes as a
+ *    single FRAME_SHARED instead of chunks.
+ * Parameters: Frame, request, chars already queued
+ * Returns: Chars queued after this frame
+ * **************************************************************/
+static long nextFrame(struct outFrame *frame, struct otpRequest *req,
+      long queued) {
+   long n = req->len - queued;
+   int idLen = 0;
+   int i;
+
+   if (n > FRAME_MAX && !req->shared) {
+      n = FRAME_MAX;
+   }
+   frame->last = queued + n == req->len;
+
+   if (req->padId != NULL && queued == 0) {
+      idLen = strlen(req->padId);
+      putFrameHeader(frame->pad, FRAME_PAD, PAD_OFFSET + idLen);
+      putPadOffset(frame->pad + FRAME_HEADER, req->padOffset);
+      memcpy(frame->pad + FRAME_HEADER + PAD_OFFSET, req->padId, idLen);
+      idLen += FRAME_HEADER + PAD_OFFSET;
+   }
+
+   putFrameHeader(frame->header, FRAME_CHUNK, n);
+   putFrameHeader(frame->end, FRAME_END, 0);
+   frame->passFd = -1;
+   frame->iov[PIECE_HANDSHAKE].iov_base = &frame->handshake;
+   frame->iov[PIECE_HANDSHAKE].iov_len = 0;
+   frame->iov[PIECE_PAD].iov_base = frame->pad;
+   frame->iov[PIECE_PAD].iov_len = idLen;
+   frame->iov[PIECE_HEADER].iov_base = frame->header;
+   frame->iov[PIECE_HEADER].iov_len = n > 0 ? FRAME_HEADER : 0;
+   frame->iov[PIECE_TEXT].iov_base = (char*)req->text + queued;
+   frame->iov[PIECE_TEXT].iov_len = n;
+   frame->iov[PIECE_KEY].iov_base = (char*)req->key + queued;
+   frame->iov[PIECE_KEY].iov_len = req->padId != NULL ? 0 : n;
+   frame->iov[PIECE_END].iov_base = frame->end;
+   frame->iov[PIECE_END].iov_len = frame->last ? FRAME_HEADER : 0;
+
+   for (i = 0; i < PIECES; i++) {
+      frame->fd[i] = -1;
+   }
+   frame->fd[PIECE_TEXT] = req->textFd;
+   frame->offset[PIECE_TEXT] = queued;
+   frame->fd[PIECE_KEY] = req->padId != NULL ? -1 : req->keyFd;
+   frame->offset[PIECE_KEY] = queued;
+   frame->part = 0;
+
+   if (req->shared) {
+      putFrameHeader(frame->header, FRAME_SHARED, SHARED_FRAME);
+      putPadOffset(frame->header + FRAME_HEADER, req->textOffset);
+      putPadOffset(frame->header + FRAME_HEADER + 8, req->keyOffset);
+      putPadOffset(frame->header + FRAME_HEADER + 16, n);
+      frame->iov[PIECE_HEADER].iov_len = FRAME_HEADER + SHARED_FRAME;
+      frame->iov[PIECE_TEXT].iov_len = 0;
+      frame->iov[PIECE_KEY].iov_len = 0;
+   }
+   return queued + n;
+}
+
+/****************************************************************
+ * Description: Writes as much of the frame as the socket takes.
+ *    Pieces in memory go out together with sendmsg(), corked when
+ *    file data follows; file pieces go out with sendfile().
+ * Parameters: Socket, frame
+ * Returns: 1 once the frame is sent, 0 if the socket is full, -1 on
+ *    error
+ * **************************************************************/
+static int sendFrame(int socketFD, struct outFrame *frame) {
+   union {
+      char buf[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr align;
+   } control;
+   struct cmsghdr *cmsg;
+   struct iovec *iov;
+   struct msghdr msg;
+   int count, more, i;
+   ssize_t n;
+
+   while (frame->part < PIECES) {
+      iov = frame->iov + frame->part;
+
+      if (iov->iov_len == 0) {
+	 n = 0;
+      }else if (frame->fd[frame->part] >= 0) {
+	 n = sendfile(socketFD, frame->fd[frame->part],
+	       &frame->offset[frame->part], iov->iov_len);
+      }else{
+	 count = 1;
+	 while (frame->part + count < PIECES && frame->fd[frame->part + count] < 0) {
+	    count++;
+	 }
+	 more = 0;
+	 for (i = frame->part + count; i < PIECES; i++) {
+	    more |= frame->iov[i].iov_len > 0;
+	 }
+
+	 memset(&msg, 0, sizeof(msg));
+	 msg.msg_iov = iov;
+	 msg.msg_iovlen = count;
+	 // Shared memory rides along with the handshake byte
+	 if (frame->part == PIECE_HANDSHAKE && frame->passFd >= 0) {
+	    msg.msg_control = control.buf;
+	    msg.msg_controllen = sizeof(control.buf);
+	    cmsg = CMSG_FIRSTHDR(&msg);
+	    cmsg->cmsg_level = SOL_SOCKET;
+	    cmsg->cmsg_type = SCM_RIGHTS;
+	    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	    memcpy(CMSG_DATA(cmsg), &frame->passFd, sizeof(int));
+	 }
+	 n = sendmsg(socketFD, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+	 if (n > 0) {
+	    frame->passFd = -1;
+	 }
+      }
+
+      if (n < 0) {
+	 if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	    return 0;
+	 }
+	 if (errno == EINTR) {
+	    continue;
+	 }
+	 // A rejecting server stops reading, its reply says why
+	 if (errno == EPIPE || errno == ECONNRESET) {
+	    frame->part = PIECES;
+	    return 1;
+	 }
+	 return -1;
+      }
+
+      // Step past what went out
+      while (frame->part < PIECES && n >= (ssize_t)frame->iov[frame->part].iov_len) {
+	 n -= frame->iov[frame->part].iov_len;
+	 frame->part++;
+      }
+      if (frame->part < PIECES) {
+	 frame->iov[frame->part].iov_base =
+	    (char*)frame->iov[frame->part].iov_base + n;
+	 frame->iov[frame->part].iov_len -= n;
+      }
+   }
+   return 1;
+}
+
+/****************************************************************
+ * Description: Writes the session's frames until the socket is full
+ *    or every request handed to it is out. The handshake goes out
+ *    with the first chunk of the connection.
+ * Parameters: Client, session
+ * **************************************************************/
+static void sendJobs(struct otpClient *client, struct session *s) {
+   struct otpRequest *req;
+   int rc;
+
+   while (s->sock >= 0 && !s->connecting) {
+      if (!s->framing) {
+	 if (s->sent == s->count) {
+	    return;
+	 }
+	 req = s->jobs[(s->first + s->sent) % OTP_WINDOW];
+	 s->queued = nextFrame(&s->frame, req, s->queued);
+	 if (!s->greeted) {
+	    s->frame.handshake = FRAMED_TYPE(client->type);
+	    s->frame.iov[PIECE_HANDSHAKE].iov_len = 1;
+	    s->frame.passFd = client->sharedFd;
+	    s->greeted = 1;
+	 }
+	 s->framing = 1;
+      }
+
+      rc = sendFrame(s->sock, &s->frame);
+      if (rc < 0) {
+	 failSession(client, s, OTP_FAILED, strerror(errno));
+      }
+      if (rc <= 0) {
+	 return;
+      }
+      s->framing = 0;
+      if (s->frame.last) {
+	 s->sent++;
+	 s->queued = 0;
+      }
+   }
+}
+
+/****************************************************************
+ * Description: Hands the complete result frames in the session's
+ *    buffer to the oldest request in flight and drops them. An end
+ *    frame finishes that request.
+ * Parameters: Client, session
+ * Returns: 0, or -1 if the session failed
+ * **************************************************************/
+static int takeFrames(struct otpClient *client, struct session *s) {
+   struct otpRequest *req;
+   char *payload;
+   int start = 0;
+   uint32_t len;
+
+   while (s->inLen - start >= FRAME_HEADER) {
+      len = frameLength(s->in + start);
+      if (len > FRAME_MAX || s->count == 0) {
+	 failSession(client, s, OTP_FAILED, "bad frame from server");
+	 return -1;
+      }
+      if (s->inLen - start < FRAME_HEADER + (int)len) {
+	 break;
+      }
+
+      req = s->jobs[s->first];
+      payload = s->in + start + FRAME_HEADER;
+      switch (s->in[start]) {
+	 case FRAME_CHUNK:
+	    if (req->got + (long)len > req->len) {
+	       failSession(client, s, OTP_FAILED, "bad frame from server");
+	       return -1;
+	    }
+	    if (req->sink != NULL) {
+	       req->sink(req, payload, len);
+	    }else{
+	       memcpy(req->out + req->got, payload, len);
+	    }
+	    req->got += len;
+	    break;
+	 case FRAME_END:
+	    // A shared request's result is where its text was
+	    if (req->shared) {
+	       if (req->sink != NULL && req->len > 0) {
+		  req->sink(req, req->text, req->len);
+	       }else if (req->sink == NULL && req->out != req->text) {
+		  memcpy(req->out, req->text, req->len);
+	       }
+	       req->got = req->len;
+	    }
+	    if (req->sink != NULL) {
+	       req->sink(req, NULL, 0);
+	    }
+	    finish(client, req, OTP_DONE, "", 0);
+	    s->first = (s->first + 1) % OTP_WINDOW;
+	    s->count--;
+	    s->sent--;
+	    break;
+	 case FRAME_ERROR:
+	    // The daemon hangs up after an error
+	    finish(client, req, OTP_SERVER_ERROR, payload, len);
+	    s->first = (s->first + 1) % OTP_WINDOW;
+	    s->count--;
+	    failSession(client, s, OTP_FAILED, "server hung up after an error");
+	    return -1;
+	 default:
+	    failSession(client, s, OTP_FAILED, "bad frame from server");
+	    return -1;
+      }
+      start += FRAME_HEADER + len;
+   }
+
+   memmove(s->in, s->in + start, s->inLen - start);
+   s->inLen -= start;
+   return 0;
+}
+
+// Reads what the session's socket holds and takes the results out
+static void readResults(struct otpClient *client, struct session *s) {
+   int n;
+
+   while (s->sock >= 0) {
+      n = read(s->sock, s->in + s->inLen, FRAME_HEADER + FRAME_MAX - s->inLen);
+      if (n > 0) {
+	 s->inLen += n;
+	 // The handshake reply leads the results
+	 if (!s->accepted) {
+	    if (s->in[0] != client->type) {
+	       failSession(client, s, OTP_REJECTED, "not accepted by the daemon");
+	       return;
+	    }
+	    memmove(s->in, s->in + 1, --s->inLen);
+	    s->accepted = 1;
+	 }
+	 if (takeFrames(client, s) < 0) {
+	    return;
+	 }
+	 continue;
+      }
+      if (n == 0) {
+	 // An idle connection is opened again when it is next needed
+	 failSession(client, s, OTP_FAILED, "server hung up before the result");
+	 return;
+      }
+      if (errno == EINTR) {
+	 continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+	 failSession(client, s, OTP_FAILED, strerror(errno));
+      }
+      return;
+   }
+}
+
+// Hands waiting requests to the connections with the fewest in flight
+// and starts sending them
+static void handOut(struct otpClient *client) {
+   struct session *s;
+   int best, i;
+
+   while (client->waiting.head != NULL) {
+      best = 0;
+      for (i = 1; i < client->conns; i++) {
+	 if (client->sessions[i].count < client->sessions[best].count) {
+	    best = i;
+	 }
+      }
+      s = &client->sessions[best];
+      if (s->count == OTP_WINDOW) {
+	 break;
+      }
+      if (s->sock < 0 && openSession(client, s) < 0) {
+	 finish(client, pop(&client->waiting), OTP_FAILED, strerror(errno),
+	       strlen(strerror(errno)));
+	 continue;
+      }
+      s->jobs[(s->first + s->count) % OTP_WINDOW] = pop(&client->waiting);
+      s->count++;
+   }
+
+   for (i = 0; i < client->conns; i++) {
+      sendJobs(client, &client->sessions[i]);
+   }
+}
+
+void otpInit(struct otpRequest *req) {
+   memset(req, 0, sizeof(*req));
+   req->textFd = -1;
+   req->keyFd = -1;
+}
+
+// Resolves host:port, or the Unix socket at host if it is a path
+static int resolve(struct otpClient *client, const char *host, int port) {
+   struct sockaddr_un *local = (struct sockaddr_un*)&client->addr;
+   struct addrinfo hints, *found;
+   char service[16];
+
+   if (strchr(host, '/') != NULL) {
+      if (strlen(host) >= sizeof(local->sun_path)) {
+	 errno = ENAMETOOLONG;
+	 return -1;
+      }
+      local->sun_family = AF_UNIX;
+      strcpy(local->sun_path, host);
+      client->addrLen = sizeof(*local);
+      return 0;
+   }
+
+   // The daemons listen on IPv4
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   snprintf(service, sizeof(service), "%d", port);
+   if (getaddrinfo(host, service, &hints, &found) != 0) {
+      errno = EHOSTUNREACH;
+      return -1;
+   }
+   memcpy(&client->addr, found->ai_addr, found->ai_addrlen);
+   client->addrLen = found->ai_addrlen;
+   freeaddrinfo(found);
+   return 0;
+}
+
+struct otpClient* otpConnect(const char *host, int port, char type,
+      int conns) {
+   struct otpClient *client;
+   struct epoll_event events[MAX_EVENTS];
+   struct session *s;
+   int pending = 0;
+   int i, n;
+
+   if (conns < 1 || (type != 'e' && type != 'd')) {
+      errno = EINVAL;
+      return NULL;
+   }
+
+   client = calloc(1, sizeof(struct otpClient));
+   if (client == NULL) {
+      return NULL;
+   }
+   client->sharedFd = -1;
+   client->epoll = -1;
+   if (resolve(client, host, port) < 0) {
+      otpClose(client);
+      return NULL;
+   }
+   client->type = type;
+   client->conns = conns;
+   client->sessions = calloc(conns, sizeof(struct session));
+   client->epoll = epoll_create1(EPOLL_CLOEXEC);
+   if (client->sessions == NULL || client->epoll < 0) {
+      otpClose(client);
+      return NULL;
+   }
+
+   for (i = 0; i < conns; i++) {
+      client->sessions[i].sock = -1;
+   }
+   for (i = 0; i < conns; i++) {
+      client->sessions[i].in = malloc(FRAME_HEADER + FRAME_MAX);
+      if (client->sessions[i].in == NULL ||
+	    openSession(client, &client->sessions[i]) < 0) {
+	 otpClose(client);
+	 return NULL;
+      }
+   }
+   // The first connects are waited for, so an unreachable daemon is
+   // reported here rather than by every request
+   for (i = 0; i < conns; i++) {
+      pending += client->sessions[i].connecting;
+   }
+   while (pending > 0) {
+      n = epoll_wait(client->epoll, events, MAX_EVENTS, -1);
+      if (n < 0 && errno == EINTR) {
+	 continue;
+      }
+      for (i = 0; i < n; i++) {
+	 s = events[i].data.ptr;
+	 if (!s->connecting) {
+	    continue;
+	 }
+	 if (finishConnect(client, s) < 0) {
+	    break;
+	 }
+	 pending--;
+      }
+      if (n < 0 || i < n) {
+	 n = errno;
+	 otpClose(client);
+	 errno = n;
+	 return NULL;
+      }
+   }
+   return client;
+}
+
+// Whether len bytes at p lie in the shared memory
+static int inShared(struct otpClient *client, const char *p, long len) {
+   return client->shared != NULL && p >= client->shared &&
+      p <= client->shared + client->sharedLen &&
+      len <= client->shared + client->sharedLen - p;
+}
+
+int otpSubmit(struct otpClient *client, struct otpRequest *req) {
+   if (req->len < 0 || (req->text == NULL && req->len > 0) ||
+	 (req->padId == NULL && req->key == NULL && req->len > 0) ||
+	 (req->padId != NULL && strlen(req->padId) > KEY_ID_MAX) ||
+	 (req->out == NULL && req->sink == NULL && req->len > 0)) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   req->status = OTP_PENDING;
+   req->error[0] = '\0';
+   req->got = 0;
+
+   // Text and key both in shared memory go by reference
+   req->shared = req->len > 0 && inShared(client, req->text, req->len) &&
+      (req->padId != NULL || inShared(client, req->key, req->len));
+   if (req->shared) {
+      req->textOffset = req->text - client->shared;
+      req->keyOffset = req->padId != NULL ? 0 : req->key - client->shared;
+   }
+   push(&client->waiting, req);
+   client->outstanding++;
+   return 0;
+}
+
+int otpPoll(struct otpClient *client, int timeout) {
+   struct epoll_event events[MAX_EVENTS];
+   struct session *s;
+   int n, i;
+
+   handOut(client);
+   if (client->done.len > 0) {
+      timeout = 0;
+   }
+
+   n = epoll_wait(client->epoll, events, MAX_EVENTS, timeout);
+   if (n < 0) {
+      return errno == EINTR ? client->done.len : -1;
+   }
+   for (i = 0; i < n; i++) {
+      s = events[i].data.ptr;
+      if (s->connecting && finishConnect(client, s) < 0) {
+	 continue;
+      }
+      sendJobs(client, s);
+      readResults(client, s);
+   }
+
+   // Fill the room results made
+   handOut(client);
+   return client->done.len;
+}
+
+struct otpRequest* otpComplete(struct otpClient *client) {
+   struct otpRequest *req = pop(&client->done);
+
+   if (req != NULL) {
+      client->outstanding--;
+   }
+   return req;
+}
+
+int otpOutstanding(struct otpClient *client) {
+   return client->outstanding;
+}
+
+int otpFd(struct otpClient *client) {
+   return client->epoll;
+}
+
+int otpShare(struct otpClient *client, long bytes) {
+   int i;
+
+   bytes &= ~(long)(SHARE_ALIGN - 1);
+   if (client->addr.ss_family != AF_UNIX || client->shared != NULL ||
+	 bytes <= 0) {
+      errno = EINVAL;
+      return -1;
+   }
+   for (i = 0; i < client->conns; i++) {
+      if (client->sessions[i].greeted) {
+	 errno = EBUSY;
+	 return -1;
+      }
+   }
+
+   // Sealed so the daemon can trust the size it maps
+   client->sharedFd = memfd_create("otpclient", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   if (client->sharedFd < 0) {
+      return -1;
+   }
+   if (ftruncate(client->sharedFd, bytes) < 0 ||
+	 fcntl(client->sharedFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0) {
+      close(client->sharedFd);
+      client->sharedFd = -1;
+      return -1;
+   }
+   client->shared = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+	 client->sharedFd, 0);
+   if (client->shared == MAP_FAILED) {
+      client->shared = NULL;
+      close(client->sharedFd);
+      client->sharedFd = -1;
+      return -1;
+   }
+   client->sharedLen = bytes;
+   return 0;
+}
+
+void* otpShareAlloc(struct otpClient *client, long len) {
+   long need = (sizeof(struct shareBlock) + len + SHARE_ALIGN - 1) &
+      ~(long)(SHARE_ALIGN - 1);
+   struct shareBlock *block;
+   long at;
+
+   if (client->shared == NULL || len <= 0 || need > client->sharedLen ||
+	 (client->used > 0 && client->head == client->tail)) {
+      return NULL;
+   }
+   if (client->used == 0) {
+      client->head = client->tail = 0;
+   }
+
+   if (client->head < client->tail) {
+      if (client->tail - client->head < need) {
+	 return NULL;
+      }
+      at = client->head;
+   }else if (client->sharedLen - client->head >= need) {
+      at = client->head;
+   }else if (client->tail >= need) {
+      // Skip the end of the ring, it is freed with the block before
+      block = (struct shareBlock*)(client->shared + client->head);
+      block->size = client->sharedLen - client->head;
+      block->free = 1;
+      client->used += block->size;
+      at = 0;
+   }else{
+      return NULL;
+   }
+
+   block = (struct shareBlock*)(client->shared + at);
+   block->size = need;
+   block->free = 0;
+   client->head = (at + need) % client->sharedLen;
+   client->used += need;
+   return block + 1;
+}
+
+void otpShareFree(struct otpClient *client, void *p) {
+   struct shareBlock *block;
+
+   if (p == NULL) {
+      return;
+   }
+   block = (struct shareBlock*)p - 1;
+   block->free = 1;
+
+   // Reclaim from the tail up to the oldest block still in use
+   while (client->used > 0) {
+      block = (struct shareBlock*)(client->shared + client->tail);
+      if (!block->free) {
+	 break;
+      }
+      client->used -= block->size;
+      client->tail = (client->tail + block->size) % client->sharedLen;
+   }
+}
+
+void otpClose(struct otpClient *client) {
+   int i;
+
+   if (client->sessions != NULL) {
+      for (i = 0; i < client->conns; i++) {
+	 if (client->sessions[i].sock >= 0) {
+	    close(client->sessions[i].sock);
+	 }
+	 free(client->sessions[i].in);
+      }
+   }
+   if (client->epoll >= 0) {
+      close(client->epoll);
+   }
+   if (client->shared != NULL) {
+      munmap(client->shared, client->sharedLen);
+      close(client->sharedFd);
+   }
+   free(client->sessions);
+   free(client);
+}
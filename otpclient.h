@@ -0,0 +1,116 @@
+/*****************************************************************
+*Description: libotpclient, the framed protocol client (see
+*   protocol.h) as a library, for programs that cipher without
+*   running enc_client. Requests are submitted, otpPoll() drives the
+*   sockets and finished requests are collected with otpComplete(),
+*   so one thread can keep hundreds of requests outstanding.
+*   A client holds a pool of connections to one daemon and hands
+*   each request to the connection with the fewest in flight, up to
+*   OTP_WINDOW each; the rest wait their turn inside the client.
+*   A client must only be used by one thread at a time.
+* ***************************************************************/
+#ifndef OTPCLIENT_H
+#define OTPCLIENT_H
+
+#include <stdint.h>
+
+// Requests one connection sends ahead of their results
+#define OTP_WINDOW 16
+
+struct otpClient;
+
+enum otpStatus {
+   OTP_PENDING,
+   OTP_DONE,
+   OTP_SERVER_ERROR,	// The daemon refused it, error holds its reason
+   OTP_FAILED,		// The connection failed, error says how
+   OTP_REJECTED		// The daemon is of the other type
+};
+
+/*****************************************************************
+ * One text to cipher. The caller owns it and keeps it, and the
+ * memory it points at, in place from otpSubmit() until otpComplete()
+ * hands it back. Set it up with otpInit(), then fill in the text,
+ * either a key or a pad, and where the result goes.
+ * ***************************************************************/
+struct otpRequest {
+   const char *text;
+   long len;
+   int textFd;		// File the text is sent from with sendfile(), or -1
+   const char *key;	// len key bytes, unused when padId is set
+   int keyFd;		// As textFd, for the key
+   const char *padId;	// Key ID of a pad held by the daemon, or NULL
+   uint64_t padOffset;
+   char *out;		// len bytes the result is written to, or NULL
+   // Called with each piece of the result, in order, instead of out,
+   // then with len 0 as soon as the result is complete
+   void (*sink)(struct otpRequest *req, const char *data, long len);
+   void *user;		// Left alone by the library
+
+   enum otpStatus status;
+   char error[128];
+
+   // Private to the library
+   struct otpRequest *next;
+   long got;
+   int shared;		// Text and key are in shared memory, at
+   uint64_t textOffset, keyOffset;
+};
+
+void otpInit(struct otpRequest *req);
+
+/*****************************************************************
+ *Description: Connects to the daemon of the given type ('e' or 'd')
+ *   on host:port with conns connections. A host containing a '/' is
+ *   the path of the daemon's Unix socket, and port is ignored.
+ *Returns: The client, or NULL with errno set
+ * ***************************************************************/
+struct otpClient* otpConnect(const char *host, int port, char type,
+      int conns);
+
+/*****************************************************************
+ *Description: Shares bytes of memory with a daemon on its Unix
+ *   socket, passed along with the handshake of every connection.
+ *   A request whose text, and key unless it names a pad, were taken
+ *   from otpShareAlloc() is sent as their offsets instead of their
+ *   bytes, in one frame whatever its length, and the daemon ciphers
+ *   it in place: on completion the text holds the result, which is
+ *   also copied to out or passed to the sink as usual if they are
+ *   set elsewhere. Call before the first request is submitted.
+ *Returns: 0, or -1 with errno set (EINVAL if not on a Unix socket)
+ * ***************************************************************/
+int otpShare(struct otpClient *client, long bytes);
+
+// A block of len bytes of the shared memory, or NULL if there is no
+// room left; blocks are reclaimed in the order they were taken
+void* otpShareAlloc(struct otpClient *client, long len);
+
+// Gives a block back once no request in flight uses it
+void otpShareFree(struct otpClient *client, void *block);
+
+// Queues the request. Returns 0, or -1 if it is not well formed.
+int otpSubmit(struct otpClient *client, struct otpRequest *req);
+
+/*****************************************************************
+ *Description: Sends and receives whatever the sockets allow, waiting
+ *   up to timeout milliseconds (-1 for ever) if nothing can be done
+ *   now and nothing is finished.
+ *Returns: Requests waiting in otpComplete(), or -1 with errno set
+ * ***************************************************************/
+int otpPoll(struct otpClient *client, int timeout);
+
+// Next finished request, oldest first, or NULL
+struct otpRequest* otpComplete(struct otpClient *client);
+
+// Requests submitted and not yet handed back by otpComplete()
+int otpOutstanding(struct otpClient *client);
+
+// Descriptor that turns readable when otpPoll() has work, for
+// callers that wait in their own event loop. Requests submitted since
+// the last otpPoll() only start moving at the next one.
+int otpFd(struct otpClient *client);
+
+// Closes the connections. Requests still outstanding are dropped.
+void otpClose(struct otpClient *client);
+
+#endif
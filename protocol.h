@@ -0,0 +1,98 @@
+/*****************************************************************
+*Description: Wire format shared by the clients and the daemons.
+*
+*   A connection opens with a single handshake byte. Lower case
+*   ('e'/'d') selects the original protocol: the server acks the
+*   handshake, then the text, before the key is sent, and messages
+*   are capped at MAX_SIZE. Upper case ('E'/'D') selects the framed
+*   protocol below, which has no size limit and no waits: the client
+*   sends its frames right behind the handshake.
+*
+*   The server answers the handshake with its own lower case type
+*   byte, which a framed server sends ahead of its first frame. Both
+*   sides exchange frames of a one byte type and a four byte length
+*   in network order:
+*     client FRAME_PAD    length 8 + n, pad offset as 8 bytes in
+*                         network order, then an n byte key ID
+*     client FRAME_CHUNK  length n, n text bytes then n key bytes,
+*                         or only the text after a FRAME_PAD
+*     client FRAME_SHARED length 24, text offset, key offset and
+*                         length as 8 bytes each in network order,
+*                         naming the text and key in shared memory
+*     client FRAME_END    length 0, the message is complete
+*     server FRAME_CHUNK  length n, n result bytes
+*     server FRAME_END    length 0, the result is complete
+*     server FRAME_ERROR  length n, n byte message, then close
+*   A job that opens with FRAME_PAD is ciphered with the daemon's pad
+*   of that key ID, starting at the offset, instead of a key sent by
+*   the client.
+*   After an end frame the client may start its next job on the same
+*   connection, without a new handshake. Results come back in the
+*   order the jobs were sent.
+*
+*   A client on the daemon's Unix socket may pass a memfd, sealed
+*   against shrinking, with SCM_RIGHTS alongside its framed handshake
+*   byte. The daemon maps it, and a FRAME_SHARED then stands in for
+*   the chunks of a job: the text and key are read from the mapping
+*   and the result overwrites the text there, so the end frame is the
+*   only reply. The key offset is ignored after a FRAME_PAD.
+* ***************************************************************/
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#define FRAME_PAD 'K'
+#define FRAME_CHUNK 'C'
+#define FRAME_END 'F'
+#define FRAME_SHARED 'M'
+#define FRAME_ERROR 'X'
+
+// Bytes in front of the key ID of a FRAME_PAD
+#define PAD_OFFSET 8
+// Length of a FRAME_SHARED
+#define SHARED_FRAME 24
+
+// Largest message of the original protocol
+#define MAX_SIZE 100000
+
+#define FRAME_HEADER 5
+// Largest chunk either side will put in one frame. Big enough for the
+// daemon to spread a chunk over its cipher threads.
+#define FRAME_MAX (1 << 20)
+
+// Handshake byte asking for the framed protocol
+#define FRAMED_TYPE(type) ((type) - 'a' + 'A')
+
+static inline void putFrameHeader(char *buf, char type, uint32_t len) {
+   uint32_t n = htonl(len);
+
+   buf[0] = type;
+   memcpy(buf + 1, &n, sizeof(n));
+}
+
+static inline uint32_t frameLength(const char *buf) {
+   uint32_t n;
+
+   memcpy(&n, buf + 1, sizeof(n));
+   return ntohl(n);
+}
+
+// Pad offsets and the fields of a FRAME_SHARED
+static inline void putPadOffset(char *buf, uint64_t offset) {
+   uint64_t n = htobe64(offset);
+
+   memcpy(buf, &n, sizeof(n));
+}
+
+static inline uint64_t padOffset(const char *buf) {
+   uint64_t n;
+
+   memcpy(&n, buf, sizeof(n));
+   return be64toh(n);
+}
+
+#endif
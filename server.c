@@ -0,0 +1,1892 @@
+/*****************************************************************
+*Description: Listening socket, worker management and the event
+*   loop shared by enc_server, dec_server and otp_server.
+* ***************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY
+
+#include "server.h"
+#include "protocol.h"
+#include "keystore.h"
+#include "ledger.h"
+#include "metrics.h"
+#include "uring.h"
+
+#define MAX_EVENTS 256
+#define MIN_BUFFER 4096
+#define URING_ENTRIES 256
+// The TCP socket and the Unix socket
+#define MAX_LISTENERS 2
+// Connections left waiting to be accepted, unless -b says otherwise;
+// the kernel caps it at net.core.somaxconn
+#define DEFAULT_BACKLOG 4096
+
+// Pooled buffers come in powers of two from MIN_BUFFER, the largest
+// class holds the biggest framed chunk with its key
+#define POOL_CLASSES 11
+// Idle bytes kept per class, and idle connections kept
+#define POOL_BYTES (32 << 20)
+#define POOL_CONNS 1024
+// Reads a framed connection gets per wakeup of the epoll loop, so one
+// client streaming without pause cannot keep the others waiting
+#define STEP_READS 8
+// Nanoseconds between reports of rejected handshakes, the metrics
+// count every one
+#define REJECT_REPORT 10000000000ULL
+
+// What a completion on the ring is for, in the low bits of its user
+// data, above them the connection
+enum uringOp {
+   OP_ACCEPT,
+   OP_HANDSHAKE,	// Receive of the handshake byte
+   OP_POLL,		// Original protocol, waiting for the socket
+   OP_RECV,
+   OP_SEND,
+   OP_SYNC,		// Poll of the ledger's sync notices, no connection
+   OP_MASK = 7
+};
+
+// Where a connection is in the job
+enum connState {
+   LISTENING,		// A listening socket, its events are new clients
+   WANT_HANDSHAKE,	// Waiting for the client's type byte
+   WANT_TEXT,		// Acked the handshake, waiting for the text
+   WANT_KEY,		// Acked the text, waiting for enough key
+   SEND_REPLY,		// Writing the result back
+   FRAMED,		// Framed protocol, ciphering chunks as they arrive
+   DRAINING		// Done writing, discarding input until the client hangs up
+};
+
+// Room for the descriptor a local client passes with its handshake
+union handshakeControl {
+   char buf[CMSG_SPACE(sizeof(int))];
+   struct cmsghdr align;
+};
+
+struct connection {
+   int sock;
+   enum connState state;
+   char *text;
+   char *key;
+   int textCap, textLen;
+   int keyCap, keyLen;
+   char *reply;
+   int replyCap, replyLen, replySent;
+   // Framed protocol: received bytes not yet handled, from inStart
+   char *in;
+   int inCap, inStart, inLen;
+   char type;		// Handshake byte served, in lower case
+   enum cipherDirection dir;
+   int closing;		// Close once the queued reply is out
+   int ackPending;	// Handshake ack not sent yet
+   // Pad keying the current job, or NULL if the client sends the key
+   const struct pad *pad;
+   uint64_t padNext;	// Pad offset of the next chunk
+   // Journal bytes to be on disk before the queued reply may go out,
+   // 0 if it claimed no pad range
+   uint64_t syncMark;
+   int syncing;		// On the sync list
+   // metricsNow() times: first bytes of the next frame in, the last
+   // read or receive, and the queued reply complete (0 for none)
+   uint64_t frameSince, lastFill, replySince;
+   // Memory shared by a client on the Unix socket, or NULL
+   char *shared;
+   uint64_t sharedLen;
+   // A shared range to cipher once its claim is synced, heldLen 0 if
+   // none; ciphered there, it would be out before the claim is safe
+   char *heldText;
+   const char *heldKey;
+   uint64_t heldLen;
+   // io_uring engine only
+   char handshake;	// Received into here, with a descriptor in control
+   struct msghdr msg;
+   struct iovec iov;
+   union handshakeControl control;
+   int ringIO;		// Framed reads and writes go through the ring
+   int pending;		// Operations in flight
+   int failed;		// Close once none are in flight
+   int ready;		// On the ready list
+   int stalled;		// On the stalled list
+   struct connection *next;	// Idle in the pool, or next on a list
+};
+
+/*******************************************************************
+ * Buffers and connections of this worker that are not in use. Each
+ * buffer is taken from the smallest class that fits and given back
+ * when its connection closes, so once the pool is warm, serving
+ * connections and jobs makes no heap allocations. Idle buffers hold
+ * the link to the next one in their first bytes. Workers are single
+ * threaded, so the pool needs no locks.
+ * ****************************************************************/
+static struct {
+   char *idle[POOL_CLASSES];
+   int idleCount[POOL_CLASSES];
+   struct connection *conns;
+   int connCount;
+} pool;
+
+// Connections of the epoll loop that ran out of budget with input
+// left, in turn order. Edge triggered epoll does not report them again,
+// so they are stepped before the next wait.
+static struct connection *readyHead, *readyTail;
+// Connections holding a reply until the ledger journal is synced, and
+// the eventfd of the sync thread, -1 without a ledger
+static struct connection *syncHead, *syncTail;
+static int syncEvents = -1;
+static int useLedger = 0;
+// Connections of the io_uring loop whose next operation found no room
+// in the ring, to post again once the loop has seen its completions
+static struct connection *stalledHead, *stalledTail;
+
+static volatile sig_atomic_t stopping = 0;
+// Handshake bytes served, in lower case
+static const char *serviceTypes;
+static int cipherThreads = 1;
+static int useUring = 0;
+static int listeners[MAX_LISTENERS];
+static int listenerCount;
+static int backlog = DEFAULT_BACKLOG;
+// With -r, each worker slot's own socket on the port, or NULL
+static int *shardSockets;
+// With -a, pin each worker's loop to a CPU
+static int pinWorkers = 0;
+
+// Error function used for reporting issues
+void error(const char *msg) {
+   perror(msg);
+   exit(1);
+}
+
+// Set up the address struct for the server socket
+static void setupAddressStruct(struct sockaddr_in* address,
+      int portNumber){
+
+   // Clear out the address struct
+   memset((char*) address, '\0', sizeof(*address));
+
+   // The address should be network capable
+   address->sin_family = AF_INET;
+   // Store the port number
+   address->sin_port = htons(portNumber);
+   // Allow a client at any address to connect to this server
+   address->sin_addr.s_addr = INADDR_ANY;
+}
+
+/*******************************************************************
+ *Description: Listens on the TCP port. Sockets bound with reusePort
+ *   set form a group that the kernel spreads new connections over,
+ *   each with its own accept queue.
+ *Parameters: Port, SO_REUSEPORT flag
+ *Returns: The listening socket
+ * ****************************************************************/
+static int listenPort(int port, int reusePort) {
+   struct sockaddr_in serverAddress;
+   int one = 1;
+
+   // Create the socket that will listen for connections
+   int listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+   if (listenSocket < 0) {
+      error("ERROR opening socket");
+   }
+   // A restarted daemon must not wait out its old connections
+   setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+   if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &one,
+	    sizeof(one)) < 0) {
+      error("ERROR setting SO_REUSEPORT");
+   }
+
+   // Set up the address struct for the server socket
+   setupAddressStruct(&serverAddress, port);
+
+   // Associate the socket to the port
+   if (bind(listenSocket,
+	    (struct sockaddr *)&serverAddress,
+	    sizeof(serverAddress)) < 0){
+      error("ERROR on binding");
+   }
+
+   // Start listening for connections
+   if (listen(listenSocket, backlog) < 0) {
+      error("ERROR on listen");
+   }
+   return listenSocket;
+}
+
+/*******************************************************************
+ *Description: Listens on a Unix socket at path, replacing a socket
+ *   left there by an earlier daemon. Only the daemon's user may
+ *   connect to it.
+ *Parameters: Socket path
+ *Returns: The listening socket
+ * ****************************************************************/
+static int listenLocal(const char *path) {
+   struct sockaddr_un address;
+   struct stat st;
+   mode_t mask;
+   int sock, rc;
+
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(address.sun_path)) {
+      fprintf(stderr, "SERVER: socket path too long\n");
+      exit(1);
+   }
+   strcpy(address.sun_path, path);
+
+   if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      unlink(path);
+   }
+   sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+   if (sock < 0) {
+      error("ERROR opening local socket");
+   }
+   // The socket is made with mode 0600, never more open than that
+   mask = umask(0177);
+   rc = bind(sock, (struct sockaddr*)&address, sizeof(address));
+   umask(mask);
+   if (rc < 0) {
+      error("ERROR binding local socket");
+   }
+   if (listen(sock, backlog) < 0) {
+      error("ERROR on listen");
+   }
+   return sock;
+}
+
+static void usage(char *prog) {
+   fprintf(stderr,"USAGE: %s [-u] [-r] [-a] [-w workers] [-t threads] "
+	 "[-b backlog] [-m stats port] [-L socket] [-k id=pad ...] "
+	 "[-J journal] port\n", prog);
+   exit(1);
+}
+
+static void onStop(int sig) {
+   stopping = 1;
+}
+
+// Takes a buffer of at least need bytes from the pool
+static char* takeBuffer(int need, int *cap) {
+   char *buf;
+   int c = 0;
+
+   while (c < POOL_CLASSES && (MIN_BUFFER << c) < need) {
+      c++;
+   }
+   if (c == POOL_CLASSES) {
+      error("SERVER: buffer too large for the pool");
+   }
+
+   *cap = MIN_BUFFER << c;
+   if (pool.idle[c] != NULL) {
+      buf = pool.idle[c];
+      memcpy(&pool.idle[c], buf, sizeof(char*));
+      pool.idleCount[c]--;
+      return buf;
+   }
+   buf = malloc(*cap);
+   if (buf == NULL) {
+      error("SERVER: out of memory");
+   }
+   return buf;
+}
+
+// Gives a buffer from takeBuffer() back, or frees it if its class
+// already keeps enough
+static void giveBuffer(char *buf, int cap) {
+   int c = 0;
+
+   if (buf == NULL) {
+      return;
+   }
+   while ((MIN_BUFFER << c) < cap) {
+      c++;
+   }
+   if ((long)(pool.idleCount[c] + 1) * cap > POOL_BYTES && pool.idleCount[c] > 0) {
+      free(buf);
+      return;
+   }
+   memcpy(buf, &pool.idle[c], sizeof(char*));
+   pool.idle[c] = buf;
+   pool.idleCount[c]++;
+}
+
+/*******************************************************************
+ *Description: Grows a buffer to hold at least need bytes, moving it to
+ *   a larger one from the pool.
+ *Parameters: Buffer, its capacity, bytes needed, bytes at the front
+ *   to carry over
+ * ****************************************************************/
+static void reserve(char **buf, int *cap, int need, int keep) {
+   char *grown;
+   int grownCap;
+
+   if (*cap < need) {
+      grown = takeBuffer(need, &grownCap);
+      if (keep > 0) {
+	 memcpy(grown, *buf, keep);
+      }
+      giveBuffer(*buf, *cap);
+      *buf = grown;
+      *cap = grownCap;
+   }
+}
+
+// A cleared connection, from the pool when one is idle
+static struct connection* newConnection(int sock) {
+   struct connection *conn = pool.conns;
+   int one = 1;
+
+   // Replies are written whole, Nagle would only hold the next one back
+   setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+   if (conn != NULL) {
+      pool.conns = conn->next;
+      pool.connCount--;
+      memset(conn, 0, sizeof(*conn));
+   }else{
+      conn = calloc(1, sizeof(*conn));
+      if (conn == NULL) {
+	 error("SERVER: out of memory");
+      }
+   }
+   conn->sock = sock;
+   conn->state = WANT_HANDSHAKE;
+   metricsAdd(&metrics->accepted, 1);
+   return conn;
+}
+
+// A connection standing for a listening socket in the event loops
+static struct connection* newListener(int sock) {
+   struct connection *listener = calloc(1, sizeof(*listener));
+
+   if (listener == NULL) {
+      error("SERVER: out of memory");
+   }
+   listener->sock = sock;
+   listener->state = LISTENING;
+   return listener;
+}
+
+static void closeConnection(struct connection *conn) {
+   close(conn->sock);
+   metricsAdd(&metrics->closed, 1);
+   if (conn->shared != NULL) {
+      munmap(conn->shared, conn->sharedLen);
+   }
+   giveBuffer(conn->text, conn->textCap);
+   giveBuffer(conn->key, conn->keyCap);
+   giveBuffer(conn->reply, conn->replyCap);
+   giveBuffer(conn->in, conn->inCap);
+   if (pool.connCount == POOL_CONNS) {
+      free(conn);
+      return;
+   }
+   conn->next = pool.conns;
+   pool.conns = conn;
+   pool.connCount++;
+}
+
+/*******************************************************************
+ *Description: Reads everything currently available into a buffer that
+ *   grows up to MAX_SIZE. Bytes beyond MAX_SIZE are read and dropped.
+ *Parameters: Connection socket, buffer, its capacity and fill
+ *Returns: 1 if the socket is drained, 0 on EOF, -1 on error
+ * ****************************************************************/
+static int readAvailable(int sock, char **buf, int *cap, int *len) {
+   char discard[MIN_BUFFER];
+   int room, n;
+
+   while (1) {
+      if (*len == *cap && *cap < MAX_SIZE) {
+	 reserve(buf, cap, *cap ? *cap * 2 : MIN_BUFFER, *len);
+      }
+
+      room = (*cap < MAX_SIZE ? *cap : MAX_SIZE) - *len;
+      if (room > 0) {
+	 n = read(sock, *buf + *len, room);
+      }else{
+	 n = read(sock, discard, sizeof(discard));
+      }
+
+      if (n > 0) {
+	 metricsAdd(&metrics->bytesIn, n);
+	 if (room > 0) {
+	    *len += n;
+	 }
+      }else if (n == 0) {
+	 return 0;
+      }else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	 return 1;
+      }else if (errno != EINTR) {
+	 return -1;
+      }
+   }
+}
+
+// Sends a single protocol byte. Only used while the send buffer is empty.
+static int sendByte(int sock, char c) {
+   if (write(sock, &c, 1) != 1) {
+      return -1;
+   }
+   metricsAdd(&metrics->bytesOut, 1);
+   return 0;
+}
+
+/*******************************************************************
+ *Description: Writes as much of the queued reply as the socket takes.
+ *Parameters: Connection
+ *Returns: 1 once the whole reply is sent, 0 if the socket is full,
+ *   -1 on error
+ * ****************************************************************/
+static int flushReply(struct connection *conn) {
+   int n;
+
+   while (conn->replySent < conn->replyLen) {
+      n = write(conn->sock, conn->reply + conn->replySent,
+	    conn->replyLen - conn->replySent);
+      if (n < 0) {
+	 if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	    return 0;
+	 }
+	 if (errno != EINTR) {
+	    return -1;
+	 }
+	 continue;
+      }
+      conn->replySent += n;
+      metricsAdd(&metrics->bytesOut, n);
+   }
+   return 1;
+}
+
+// Records how long the reply just sent took to get out, unless it
+// was a bare handshake ack
+static void replyDone(struct connection *conn) {
+   if (conn->replySince != 0 && conn->replyLen > 0) {
+      metricsTime(PHASE_WRITE, conn->replySince);
+   }
+   conn->replySince = 0;
+   conn->replyLen = conn->replySent = 0;
+}
+
+// Notes the time input arrived, which starts the next frame's read
+// phase if none of it was buffered
+static void inputArrived(struct connection *conn, int hadInput) {
+   conn->lastFill = metricsNow();
+   if (!hadInput) {
+      conn->frameSince = conn->lastFill;
+   }
+}
+
+/*******************************************************************
+ *Description: Reads framed input until the socket is drained or the
+ *   input buffer is full. The unhandled bytes are first moved to the
+ *   front of the buffer.
+ *Parameters: Connection
+ *Returns: 2 if the buffer filled, 1 if the socket is drained, 0 on
+ *   EOF, -1 on error
+ * ****************************************************************/
+static int fillInput(struct connection *conn) {
+   int had = conn->inLen;
+   int rc = 2;
+   int n;
+
+   if (conn->inStart > 0) {
+      memmove(conn->in, conn->in + conn->inStart, conn->inLen);
+      conn->inStart = 0;
+   }
+
+   while (conn->inLen < conn->inCap) {
+      n = read(conn->sock, conn->in + conn->inLen, conn->inCap - conn->inLen);
+      if (n > 0) {
+	 conn->inLen += n;
+      }else if (n == 0) {
+	 rc = 0;
+	 break;
+      }else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	 rc = 1;
+	 break;
+      }else if (errno != EINTR) {
+	 return -1;
+      }
+   }
+
+   if (conn->inLen > had) {
+      metricsAdd(&metrics->bytesIn, conn->inLen - had);
+      inputArrived(conn, had > 0);
+   }
+   return rc;
+}
+
+/*******************************************************************
+ *Description: Makes room for a reply frame behind the replies already
+ *   queued, and behind the handshake ack if that has not gone out
+ *   yet, so they all leave in a single write.
+ *Parameters: Connection, size of the frame
+ *Returns: Where the reply frame goes
+ * ****************************************************************/
+static char* startReply(struct connection *conn, int size) {
+   reserve(&conn->reply, &conn->replyCap, conn->replyLen + 1 + size,
+	 conn->replyLen);
+   if (conn->ackPending) {
+      conn->reply[conn->replyLen++] = conn->type;
+      conn->ackPending = 0;
+   }
+   return conn->reply + conn->replyLen;
+}
+
+// Queues an error frame and marks the connection for closing
+static void queueError(struct connection *conn, const char *msg) {
+   int len = strlen(msg);
+   char *frame = startReply(conn, FRAME_HEADER + len);
+
+   putFrameHeader(frame, FRAME_ERROR, len);
+   memcpy(frame + FRAME_HEADER, msg, len);
+   conn->replyLen += FRAME_HEADER + len;
+   conn->closing = 1;
+   metricsAdd(&metrics->errors, 1);
+}
+
+/*******************************************************************
+ *Description: Checks whether the next frame is fully buffered, and
+ *   grows the buffer to fit a chunk that is not. A bad header counts
+ *   as complete, for handleFrame() to reject.
+ *Parameters: Connection
+ *Returns: 1 if handleFrame() can act, 0 if more input is needed
+ * ****************************************************************/
+static int frameComplete(struct connection *conn) {
+   char *frame = conn->in + conn->inStart;
+   uint32_t len;
+   int size;
+
+   if (conn->inLen < FRAME_HEADER) {
+      return 0;
+   }
+   len = frameLength(frame);
+
+   switch (frame[0]) {
+      case FRAME_PAD:
+	 if (len <= PAD_OFFSET || len > PAD_OFFSET + KEY_ID_MAX) {
+	    return 1;
+	 }
+	 return conn->inLen >= FRAME_HEADER + (int)len;
+
+      case FRAME_CHUNK:
+	 if (len > FRAME_MAX) {
+	    return 1;
+	 }
+	 // Pad jobs only send the text
+	 size = conn->pad != NULL ? len : 2 * len;
+	 if (conn->inLen >= FRAME_HEADER + size) {
+	    return 1;
+	 }
+	 // Buffers start small and grow to the largest chunk seen
+	 reserve(&conn->in, &conn->inCap, FRAME_HEADER + size,
+	       conn->inStart + conn->inLen);
+	 return 0;
+
+      case FRAME_SHARED:
+	 return len != SHARED_FRAME ||
+	    conn->inLen >= FRAME_HEADER + SHARED_FRAME;
+
+      default:
+	 return 1;
+   }
+}
+
+/*******************************************************************
+ *Description: Takes the key for the next len characters of a pad job,
+ *   queueing an error if the pad has not got that many left. Under a
+ *   ledger, encrypting also needs none of them used before, and
+ *   decrypting all of them, so a decrypt cannot read out a range of
+ *   the pad that is still to encrypt.
+ *Parameters: Connection, characters
+ *Returns: The key, NULL after queueing an error
+ * ****************************************************************/
+static const char* padKey(struct connection *conn, uint64_t len) {
+   const char *key;
+   uint64_t mark;
+   int covered;
+
+   if (conn->padNext > (uint64_t)conn->pad->len ||
+	 len > conn->pad->len - conn->padNext) {
+      queueError(conn, "key range out of bounds");
+      return NULL;
+   }
+   if (conn->pad->ledger != NULL && conn->dir == CIPHER_ENCRYPT) {
+      if (ledgerClaim(conn->pad->ledger, conn->padNext, len, &mark) < 0) {
+	 queueError(conn, errno == EEXIST ? "key range already used" :
+	       errno == ENOSPC ? "key ledger full" : "key ledger unavailable");
+	 return NULL;
+      }
+      // The reply waits for the claim to be on disk
+      conn->syncMark = mark;
+      ledgerSyncWant(mark);
+   }
+   if (conn->pad->ledger != NULL && conn->dir == CIPHER_DECRYPT &&
+	 (covered = ledgerCovered(conn->pad->ledger, conn->padNext, len)) != 1) {
+      queueError(conn, covered == 0 ? "key range not yet used" :
+	    "key ledger unavailable");
+      return NULL;
+   }
+   key = conn->pad->data + conn->padNext;
+   conn->padNext += len;
+   return key;
+}
+
+/*******************************************************************
+ *Description: Ciphers a job held in the client's shared memory, in
+ *   place, leaving nothing to reply until its end frame. Under a
+ *   ledger the cipher is held until its claim is synced.
+ *Parameters: Connection, FRAME_SHARED payload
+ *Returns: 0, or -1 after queueing an error
+ * ****************************************************************/
+static int cipherShared(struct connection *conn, const char *body) {
+   uint64_t offset = padOffset(body);
+   uint64_t keyOffset = padOffset(body + 8);
+   uint64_t len = padOffset(body + 16);
+   const char *key;
+   uint64_t start;
+
+   if (conn->shared == NULL) {
+      queueError(conn, "no shared memory");
+      return -1;
+   }
+   if (len > conn->sharedLen || offset > conn->sharedLen - len ||
+	 (conn->pad == NULL && keyOffset > conn->sharedLen - len)) {
+      queueError(conn, "shared range out of bounds");
+      return -1;
+   }
+
+   if (conn->pad != NULL) {
+      key = padKey(conn, len);
+      if (key == NULL) {
+	 return -1;
+      }
+   }else{
+      key = conn->shared + keyOffset;
+   }
+
+   if (conn->syncMark != 0) {
+      conn->heldText = conn->shared + offset;
+      conn->heldKey = key;
+      conn->heldLen = len;
+      return 0;
+   }
+   start = metricsNow();
+   cipherApply(conn->dir, conn->shared + offset, conn->shared + offset, key,
+	 len);
+   metricsTime(PHASE_CIPHER, start);
+   return 0;
+}
+
+/*******************************************************************
+ *Description: Handles the next frame if it is fully buffered, queueing
+ *   its reply behind any not yet sent.
+ *Parameters: Connection
+ *Returns: 1 if a frame was handled, 0 if more input is needed
+ * ****************************************************************/
+static int handleFrame(struct connection *conn) {
+   char *frame = conn->in + conn->inStart;
+   const char *key;
+   uint64_t start;
+   char *out;
+   int size;
+   uint32_t len;
+
+   if (!frameComplete(conn)) {
+      return 0;
+   }
+   len = frameLength(frame);
+
+   switch (frame[0]) {
+      case FRAME_PAD:
+	 if (len <= PAD_OFFSET || len > PAD_OFFSET + KEY_ID_MAX) {
+	    queueError(conn, "bad key reference");
+	    return 1;
+	 }
+
+	 conn->pad = keystoreFind(frame + FRAME_HEADER + PAD_OFFSET,
+	       len - PAD_OFFSET);
+	 if (conn->pad == NULL) {
+	    queueError(conn, "unknown key");
+	    return 1;
+	 }
+	 conn->padNext = padOffset(frame + FRAME_HEADER);
+
+	 conn->inStart += FRAME_HEADER + len;
+	 conn->inLen -= FRAME_HEADER + len;
+	 return 1;
+
+      case FRAME_CHUNK:
+	 if (len > FRAME_MAX) {
+	    queueError(conn, "chunk too large");
+	    return 1;
+	 }
+	 size = conn->pad != NULL ? len : 2 * len;
+
+	 if (conn->pad != NULL) {
+	    key = padKey(conn, len);
+	    if (key == NULL) {
+	       return 1;
+	    }
+	 }else{
+	    key = frame + FRAME_HEADER + len;
+	 }
+
+	 // The whole chunk was in by the last read
+	 metricsTime(PHASE_READ, conn->frameSince);
+	 conn->frameSince = conn->lastFill;
+
+	 out = startReply(conn, FRAME_HEADER + len);
+	 putFrameHeader(out, FRAME_CHUNK, len);
+	 start = metricsNow();
+	 cipherApply(conn->dir, out + FRAME_HEADER,
+	       frame + FRAME_HEADER, key, len);
+	 metricsTime(PHASE_CIPHER, start);
+	 conn->replyLen += FRAME_HEADER + len;
+
+	 conn->inStart += FRAME_HEADER + size;
+	 conn->inLen -= FRAME_HEADER + size;
+	 return 1;
+
+      case FRAME_SHARED:
+	 if (len != SHARED_FRAME) {
+	    queueError(conn, "bad shared memory frame");
+	    return 1;
+	 }
+	 if (cipherShared(conn, frame + FRAME_HEADER) < 0) {
+	    return 1;
+	 }
+	 conn->inStart += FRAME_HEADER + len;
+	 conn->inLen -= FRAME_HEADER + len;
+	 return 1;
+
+      case FRAME_END:
+	 // The connection stays open for the client's next job
+	 putFrameHeader(startReply(conn, FRAME_HEADER), FRAME_END, 0);
+	 conn->replyLen += FRAME_HEADER;
+	 conn->pad = NULL;
+	 metricsAdd(&metrics->jobs[conn->dir], 1);
+
+	 conn->inStart += FRAME_HEADER;
+	 conn->inLen -= FRAME_HEADER;
+	 return 1;
+
+      default:
+	 queueError(conn, "unknown frame");
+	 return 1;
+   }
+}
+
+/*******************************************************************
+ *Description: Handles the frames already buffered, so that the replies
+ *   to a chunk and the end frame behind it, or to several small jobs,
+ *   go out in one write. Stops once a chunk's worth of reply is queued.
+ *Parameters: Connection
+ *Returns: Frames handled
+ * ****************************************************************/
+static int handleFrames(struct connection *conn) {
+   int handled = 0;
+
+   while (!conn->closing && conn->replyLen < FRAME_MAX && conn->heldLen == 0 &&
+	 handleFrame(conn)) {
+      handled++;
+   }
+   if (handled > 0) {
+      conn->replySince = metricsNow();
+   }
+   return handled;
+}
+
+// Sets up msg to receive a handshake byte and a descriptor with it
+static void handshakeMessage(struct msghdr *msg, struct iovec *iov,
+      char *verify, void *control, int controlLen) {
+   memset(msg, 0, sizeof(*msg));
+   iov->iov_base = verify;
+   iov->iov_len = 1;
+   msg->msg_iov = iov;
+   msg->msg_iovlen = 1;
+   msg->msg_control = control;
+   msg->msg_controllen = controlLen;
+}
+
+// The descriptor that came with a handshake, or -1
+static int passedFd(struct msghdr *msg) {
+   struct cmsghdr *cmsg;
+   int fd = -1;
+
+   for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+	 memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+      }
+   }
+   return fd;
+}
+
+/*******************************************************************
+ *Description: Maps the memory a local client shares. It must be
+ *   sealed against shrinking, or the client could pull pages out
+ *   from under the daemon.
+ *Parameters: Connection, memfd (closed here)
+ *Returns: 0, or -1 if it cannot be used
+ * ****************************************************************/
+static int mapShared(struct connection *conn, int fd) {
+   int seals = fcntl(fd, F_GET_SEALS);
+   struct stat st;
+   void *map;
+
+   // A file that is not a memfd has no seals, and one that can shrink
+   // would fault the daemon on pages that are gone
+   if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) < 0 ||
+	 st.st_size <= 0) {
+      close(fd);
+      return -1;
+   }
+   map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      return -1;
+   }
+   conn->shared = map;
+   conn->sharedLen = st.st_size;
+   return 0;
+}
+
+/*******************************************************************
+ *Description: Acts on the client's handshake byte, which picks the
+ *   direction the connection's jobs are ciphered in. Framed clients
+ *   may already have their frames in flight, so their ack waits to go
+ *   out with the first reply. Original protocol clients are acked
+ *   straight away. A type the daemon does not serve is answered with
+ *   one it does, so a mismatched client can tell who it reached.
+ *   Rejections are reported at most once per REJECT_REPORT.
+ *   Memory a framed client passes along is mapped for its jobs.
+ *Parameters: Connection, handshake byte, descriptor passed with it
+ *   or -1
+ *Returns: 0, or -1 once the connection should be closed
+ * ****************************************************************/
+static int takeHandshake(struct connection *conn, char verify, int fd) {
+   static uint64_t reportedAt;
+   static unsigned long unreported;
+   uint64_t now;
+   int framed = verify == FRAMED_TYPE('e') || verify == FRAMED_TYPE('d');
+
+   conn->type = framed ? verify - 'A' + 'a' : verify;
+   if (fd >= 0 && !framed) {
+      close(fd);
+      fd = -1;
+   }
+   if (conn->type == '\0' || strchr(serviceTypes, conn->type) == NULL) {
+      metricsAdd(&metrics->rejected, 1);
+      now = metricsNow();
+      if (reportedAt == 0 || now - reportedAt >= REJECT_REPORT) {
+	 fprintf(stderr, "SERVER: rejected client of type 0x%02x",
+	       (unsigned char)verify);
+	 if (unreported > 0) {
+	    fprintf(stderr, ", %lu more since the last report", unreported);
+	 }
+	 fputc('\n', stderr);
+	 reportedAt = now;
+	 unreported = 0;
+      } else {
+	 unreported++;
+      }
+      if (fd >= 0) {
+	 close(fd);
+      }
+      if (sendByte(conn->sock, serviceTypes[0]) < 0) {
+	 return -1;
+      }
+      shutdown(conn->sock, SHUT_WR);
+      conn->state = DRAINING;
+      return 0;
+   }
+   conn->dir = conn->type == 'e' ? CIPHER_ENCRYPT : CIPHER_DECRYPT;
+
+   if (framed) {
+      reserve(&conn->in, &conn->inCap, FRAME_HEADER + 2 * MIN_BUFFER, 0);
+      reserve(&conn->reply, &conn->replyCap, 1 + FRAME_HEADER + MIN_BUFFER,
+	    0);
+      conn->ackPending = 1;
+      conn->state = FRAMED;
+      if (fd >= 0 && mapShared(conn, fd) < 0) {
+	 queueError(conn, "shared memory must be a memfd sealed against "
+	       "shrinking");
+      }
+      return 0;
+   }
+
+   if (sendByte(conn->sock, conn->type) < 0) {
+      return -1;
+   }
+   conn->state = WANT_TEXT;
+   return 0;
+}
+
+// Appends a connection to a list linked through next
+static void appendConnection(struct connection **head,
+      struct connection **tail, struct connection *conn) {
+   conn->next = NULL;
+   if (*tail != NULL) {
+      (*tail)->next = conn;
+   }else{
+      *head = conn;
+   }
+   *tail = conn;
+}
+
+/*******************************************************************
+ *Description: Checks whether the queued reply may go out. One that
+ *   ciphered with pad ranges claimed under a ledger waits on the sync
+ *   list until the claims are on disk, and if they cannot be put
+ *   there, is swapped for an error before any of it leaves. A held
+ *   shared range is ciphered once they are, and never if not.
+ *Parameters: Connection
+ *Returns: 1 if it may, 0 while it waits
+ * ****************************************************************/
+static int replySynced(struct connection *conn) {
+   uint64_t start;
+   int rc;
+
+   if (conn->syncMark == 0) {
+      return 1;
+   }
+   rc = ledgerSynced(conn->syncMark);
+   if (rc == 0) {
+      if (!conn->syncing) {
+	 conn->syncing = 1;
+	 appendConnection(&syncHead, &syncTail, conn);
+      }
+      return 0;
+   }
+   conn->syncMark = 0;
+   if (rc < 0) {
+      // Keep the handshake ack, the one reply byte in lower case
+      conn->replyLen = conn->replyLen > 0 && conn->reply[0] == conn->type;
+      queueError(conn, "key ledger unavailable");
+   }else if (conn->heldLen > 0) {
+      start = metricsNow();
+      cipherApply(conn->dir, conn->heldText, conn->heldText, conn->heldKey,
+	    conn->heldLen);
+      metricsTime(PHASE_CIPHER, start);
+   }
+   conn->heldLen = 0;
+   return 1;
+}
+
+// Takes the whole sync list, to step what waited on the last sync
+static struct connection* takeSynced(void) {
+   struct connection *list = syncHead;
+   uint64_t count;
+
+   while (read(syncEvents, &count, sizeof(count)) > 0) {
+   }
+   syncHead = syncTail = NULL;
+   return list;
+}
+
+/*******************************************************************
+ *Description: Advances a connection as far as its socket allows.
+ *   In the original protocol handshake, text and key are each gated
+ *   by an ack so the client never has the next piece in flight while
+ *   the current one is read. Framed connections cipher each chunk as
+ *   soon as it is buffered and hold at most one chunk and its reply.
+ *   They carry any number of jobs, one after another, until the
+ *   client hangs up, and read STEP_READS times at most per call.
+ *Parameters: Connection
+ *Returns: 0 to keep the connection, 1 to keep it when its input was
+ *   left unread, -1 once it should be closed
+ * ****************************************************************/
+static int stepConnection(struct connection *conn) {
+   union handshakeControl control;
+   int drained = 0, eof = 0, reads = 0;
+   struct msghdr msg;
+   struct iovec iov;
+   uint64_t start;
+   char verify;
+   int rc, n;
+
+   while (1) {
+      switch (conn->state) {
+	 case LISTENING:
+	    return 0;
+
+	 case WANT_HANDSHAKE:
+	    handshakeMessage(&msg, &iov, &verify, control.buf,
+		  sizeof(control.buf));
+	    n = recvmsg(conn->sock, &msg, MSG_CMSG_CLOEXEC);
+	    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	       return 0;
+	    }
+	    if (n <= 0 || takeHandshake(conn, verify, passedFd(&msg)) < 0) {
+	       return -1;
+	    }
+	    metricsAdd(&metrics->bytesIn, 1);
+	    break;
+
+	 case WANT_TEXT:
+	    rc = readAvailable(conn->sock, &conn->text, &conn->textCap,
+		  &conn->textLen);
+	    if (rc < 0 || (rc == 0 && conn->textLen == 0)) {
+	       return -1;
+	    }
+	    if (conn->textLen == 0) {
+	       return 0;
+	    }
+
+	    //Tell client we are ready for key
+	    if (sendByte(conn->sock, conn->type) < 0) {
+	       return -1;
+	    }
+	    conn->state = WANT_KEY;
+	    break;
+
+	 case WANT_KEY:
+	    rc = readAvailable(conn->sock, &conn->key, &conn->keyCap,
+		  &conn->keyLen);
+	    if (rc < 0 || (rc == 0 && conn->keyLen < conn->textLen)) {
+	       return -1;
+	    }
+	    if (conn->keyLen < conn->textLen) {
+	       return 0;
+	    }
+
+	    // Cipher in place, the text buffer becomes the reply
+	    start = metricsNow();
+	    cipherApply(conn->dir, conn->text, conn->text, conn->key,
+		  conn->textLen);
+	    metricsTime(PHASE_CIPHER, start);
+	    metricsAdd(&metrics->jobs[conn->dir], 1);
+	    conn->replySince = metricsNow();
+	    conn->reply = conn->text;
+	    conn->replyCap = conn->textCap;
+	    conn->replyLen = conn->textLen;
+	    conn->text = NULL;
+	    conn->textCap = 0;
+	    conn->state = SEND_REPLY;
+	    break;
+
+	 case SEND_REPLY:
+	    rc = flushReply(conn);
+	    if (rc <= 0) {
+	       return rc;
+	    }
+
+	    replyDone(conn);
+	    // Let the client read the reply before we close
+	    shutdown(conn->sock, SHUT_WR);
+	    conn->state = DRAINING;
+	    break;
+
+	 case FRAMED:
+	    if (!replySynced(conn)) {
+	       return 0;
+	    }
+	    // Finish the queued reply before taking on another frame, so
+	    // a client that stops reading stops being read from
+	    rc = flushReply(conn);
+	    if (rc <= 0) {
+	       return rc;
+	    }
+	    replyDone(conn);
+
+	    if (conn->closing) {
+	       shutdown(conn->sock, SHUT_WR);
+	       conn->state = DRAINING;
+	       break;
+	    }
+
+	    if (handleFrames(conn)) {
+	       break;
+	    }
+	    if (drained) {
+	       // The client hangs up once it has its results, hanging up
+	       // mid message abandons the job
+	       if (eof) {
+		  return -1;
+	       }
+	       // Nothing to pipeline the ack with, a client may be waiting
+	       if (conn->ackPending) {
+		  startReply(conn, 0);
+		  break;
+	       }
+	       return 0;
+	    }
+	    if (reads++ == STEP_READS) {
+	       return 1;
+	    }
+	    rc = fillInput(conn);
+	    if (rc < 0) {
+	       return -1;
+	    }
+	    drained = rc < 2;
+	    eof = rc == 0;
+	    break;
+
+	 case DRAINING:
+	    rc = readAvailable(conn->sock, &conn->key, &conn->keyCap,
+		  &conn->keyLen);
+	    return rc == 1 ? 0 : -1;
+      }
+   }
+}
+
+static void acceptClients(int epfd, int listenSocket) {
+   struct connection *conn;
+   struct epoll_event ev;
+   int sock;
+
+   while (1) {
+      sock = accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK);
+      if (sock < 0) {
+	 if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+	    continue;
+	 }
+	 if (errno != EAGAIN && errno != EWOULDBLOCK) {
+	    perror("SERVER: accept");
+	 }
+	 return;
+      }
+
+      conn = newConnection(sock);
+
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.ptr = conn;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+	 perror("SERVER: epoll_ctl");
+	 closeConnection(conn);
+      }
+   }
+}
+
+// Steps a connection for the epoll loop, closing it or putting it on
+// the ready list as it needs
+static void runConnection(struct connection *conn) {
+   int rc = stepConnection(conn);
+
+   if (rc < 0) {
+      closeConnection(conn);
+   }else if (rc > 0) {
+      conn->ready = 1;
+      appendConnection(&readyHead, &readyTail, conn);
+   }
+}
+
+/*******************************************************************
+ *Description: Event loop run by every worker. Connections are edge
+ *   triggered and carry their own state, so one process multiplexes
+ *   as many clients as it has descriptors for. Each wakeup steps the
+ *   connections with events, those whose replies waited on a journal
+ *   sync that is done, and then, once, those on the ready list.
+ *   Returns once a stop signal arrives.
+ *Parameters: Signal mask to wait with
+ * ****************************************************************/
+static void eventLoop(const sigset_t *waitMask) {
+   struct epoll_event ev, events[MAX_EVENTS];
+   struct connection *conn, *next, *watched[MAX_LISTENERS];
+   int epfd, n, i;
+
+   epfd = epoll_create1(0);
+   if (epfd < 0) {
+      error("ERROR creating epoll instance");
+   }
+
+   for (i = 0; i < listenerCount; i++) {
+      // Only one worker is woken per incoming connection
+      ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+      ev.data.ptr = watched[i] = newListener(listeners[i]);
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, listeners[i], &ev) < 0) {
+	 error("ERROR watching listen socket");
+      }
+   }
+   // Its events carry no connection
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;
+   if (syncEvents >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, syncEvents, &ev) < 0) {
+      error("ERROR watching ledger syncs");
+   }
+
+   while (!stopping) {
+      // Connections on the ready list have input already, so only
+      // look for more events
+      n = epoll_pwait(epfd, events, MAX_EVENTS, readyHead != NULL ? 0 : -1,
+	    waitMask);
+      if (n < 0) {
+	 if (errno == EINTR) {
+	    continue;
+	 }
+	 error("ERROR in epoll_wait");
+      }
+
+      for (i = 0; i < n; i++) {
+	 conn = events[i].data.ptr;
+	 if (conn == NULL) {
+	    conn = takeSynced();
+	    while (conn != NULL) {
+	       next = conn->next;
+	       conn->syncing = 0;
+	       runConnection(conn);
+	       conn = next;
+	    }
+	 }else if (conn->state == LISTENING) {
+	    acceptClients(epfd, conn->sock);
+	 }else if (!conn->ready && !conn->syncing) {
+	    // One on the ready or sync list is stepped from there
+	    runConnection(conn);
+	 }
+      }
+
+      // Those that run out of budget again wait for the next round
+      conn = readyHead;
+      readyHead = readyTail = NULL;
+      while (conn != NULL) {
+	 next = conn->next;
+	 conn->ready = 0;
+	 runConnection(conn);
+	 conn = next;
+      }
+   }
+   close(epfd);
+   for (i = 0; i < listenerCount; i++) {
+      free(watched[i]);
+   }
+}
+
+// Puts a connection whose operation could not be posted on the stalled
+// list, to try again after the next wait
+static void stall(struct connection *conn) {
+   if (!conn->stalled) {
+      conn->stalled = 1;
+      appendConnection(&stalledHead, &stalledTail, conn);
+   }
+}
+
+static void postAccept(struct uring *ring, struct connection *listener) {
+   struct io_uring_sqe *sqe = uringGet(ring);
+
+   if (sqe == NULL) {
+      stall(listener);
+      return;
+   }
+   // One submission keeps accepting until it fails
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = listener->sock;
+   sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+   sqe->accept_flags = SOCK_NONBLOCK;
+   sqe->user_data = (uintptr_t)listener | OP_ACCEPT;
+}
+
+// Starts an operation of the connection, or returns NULL with the
+// connection stalled
+static struct io_uring_sqe* postOp(struct uring *ring,
+      struct connection *conn, enum uringOp op) {
+   struct io_uring_sqe *sqe = uringGet(ring);
+
+   if (sqe == NULL) {
+      stall(conn);
+      return NULL;
+   }
+   sqe->fd = conn->sock;
+   sqe->user_data = (uintptr_t)conn | op;
+   conn->pending++;
+   return sqe;
+}
+
+// Waits for the socket to allow the original protocol's next step
+static void postPoll(struct uring *ring, struct connection *conn) {
+   struct io_uring_sqe *sqe = postOp(ring, conn, OP_POLL);
+
+   if (sqe == NULL) {
+      return;
+   }
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->poll32_events = conn->state == SEND_REPLY ? POLLOUT : POLLIN;
+}
+
+// Receives the handshake byte and any descriptor passed with it
+static void postHandshake(struct uring *ring, struct connection *conn) {
+   struct io_uring_sqe *sqe = postOp(ring, conn, OP_HANDSHAKE);
+
+   if (sqe == NULL) {
+      return;
+   }
+   handshakeMessage(&conn->msg, &conn->iov, &conn->handshake,
+	 conn->control.buf, sizeof(conn->control.buf));
+   sqe->opcode = IORING_OP_RECVMSG;
+   sqe->addr = (uintptr_t)&conn->msg;
+   sqe->len = 1;
+   sqe->msg_flags = MSG_CMSG_CLOEXEC;
+}
+
+// Waits for the ledger's sync thread to finish a sync. Returns 0, or
+// -1 if there was no room to.
+static int postSyncPoll(struct uring *ring) {
+   struct io_uring_sqe *sqe = uringGet(ring);
+
+   if (sqe == NULL) {
+      return -1;
+   }
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = syncEvents;
+   sqe->poll32_events = POLLIN;
+   sqe->user_data = OP_SYNC;
+   return 0;
+}
+
+// Receives into the free end of the input buffer
+static struct io_uring_sqe* postRecv(struct uring *ring,
+      struct connection *conn) {
+   struct io_uring_sqe *sqe = postOp(ring, conn, OP_RECV);
+
+   if (sqe == NULL) {
+      return NULL;
+   }
+   if (conn->inStart > 0) {
+      memmove(conn->in, conn->in + conn->inStart, conn->inLen);
+      conn->inStart = 0;
+   }
+   sqe->opcode = IORING_OP_RECV;
+   sqe->addr = (uintptr_t)(conn->in + conn->inLen);
+   sqe->len = conn->inCap - conn->inLen;
+   return sqe;
+}
+
+// Sends the rest of the reply, which the kernel finishes on its own
+static struct io_uring_sqe* postSend(struct uring *ring,
+      struct connection *conn) {
+   struct io_uring_sqe *sqe = postOp(ring, conn, OP_SEND);
+
+   if (sqe == NULL) {
+      return NULL;
+   }
+   sqe->opcode = IORING_OP_SEND;
+   sqe->addr = (uintptr_t)(conn->reply + conn->replySent);
+   sqe->len = conn->replyLen - conn->replySent;
+   sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+   return sqe;
+}
+
+/*******************************************************************
+ *Description: The FRAMED case of stepConnection() for the io_uring
+ *   engine, run when none of the connection's operations is in
+ *   flight. When no further frame is buffered, the receive for the
+ *   next one is linked behind the reply, so the kernel starts it as
+ *   soon as the reply is out without a trip through the loop. One
+ *   waiting on the sync list has nothing in flight until it is run
+ *   again after the sync.
+ *Parameters: Ring, connection
+ * ****************************************************************/
+static void advanceFramed(struct uring *ring, struct connection *conn) {
+   struct io_uring_sqe *sqe;
+
+   while (conn->state == FRAMED) {
+      if (!replySynced(conn)) {
+	 return;
+      }
+      if (conn->replySent < conn->replyLen) {
+	 sqe = postSend(ring, conn);
+	 // Without room for the receive it is posted once the send is
+	 // done, as it would be with a frame buffered
+	 if (sqe != NULL && !conn->closing && !frameComplete(conn) &&
+	       uringRoom(ring) > 0) {
+	    sqe->flags |= IOSQE_IO_LINK;
+	    postRecv(ring, conn);
+	 }
+	 return;
+      }
+      replyDone(conn);
+
+      if (conn->closing) {
+	 shutdown(conn->sock, SHUT_WR);
+	 conn->state = DRAINING;
+	 break;
+      }
+      if (handleFrames(conn)) {
+	 continue;
+      }
+      // Nothing to pipeline the ack with, a client may be waiting
+      if (conn->ackPending) {
+	 startReply(conn, 0);
+	 continue;
+      }
+      postRecv(ring, conn);
+      return;
+   }
+
+   // Discard input until the client hangs up
+   conn->inStart = conn->inLen = 0;
+   postRecv(ring, conn);
+}
+
+/*******************************************************************
+ *Description: Handles a completion for a connection and posts what
+ *   it needs next. Framed connections are driven by receives and
+ *   sends on the ring; the original protocol is rare enough to keep
+ *   stepConnection(), run whenever a poll says the socket is ready.
+ *Parameters: Ring, connection, operation, its result
+ * ****************************************************************/
+static void completeOp(struct uring *ring, struct connection *conn,
+      enum uringOp op, int res) {
+   conn->pending--;
+   switch (op) {
+      case OP_HANDSHAKE:
+	 if (res <= 0 ||
+	       takeHandshake(conn, conn->handshake, passedFd(&conn->msg)) < 0) {
+	    conn->failed = 1;
+	 }
+	 metricsAdd(&metrics->bytesIn, res > 0);
+	 conn->ringIO = conn->state == FRAMED;
+	 break;
+      case OP_POLL:
+	 if (res < 0 || stepConnection(conn) < 0) {
+	    conn->failed = 1;
+	 }
+	 break;
+      case OP_RECV:
+	 // Includes a receive cancelled by its failed send
+	 if (res <= 0) {
+	    conn->failed = 1;
+	 }else{
+	    metricsAdd(&metrics->bytesIn, res);
+	    if (conn->state == FRAMED) {
+	       inputArrived(conn, conn->inLen > 0);
+	       conn->inLen += res;
+	    }
+	 }
+	 break;
+      case OP_SEND:
+	 if (res < 0) {
+	    conn->failed = 1;
+	 }else{
+	    conn->replySent += res;
+	    metricsAdd(&metrics->bytesOut, res);
+	 }
+	 break;
+      default:
+	 break;
+   }
+
+   // A linked receive is still to come
+   if (conn->pending > 0) {
+      return;
+   }
+   if (conn->failed) {
+      closeConnection(conn);
+   }else if (conn->ringIO) {
+      advanceFramed(ring, conn);
+   }else{
+      postPoll(ring, conn);
+   }
+}
+
+/*******************************************************************
+ *Description: Posts again what each connection on the stalled list
+ *   was held up posting. Any that still find no room go back on it.
+ *Parameters: Ring
+ * ****************************************************************/
+static void resumeStalled(struct uring *ring) {
+   struct connection *conn = stalledHead, *next;
+
+   stalledHead = stalledTail = NULL;
+   while (conn != NULL) {
+      next = conn->next;
+      conn->stalled = 0;
+      if (conn->state == LISTENING) {
+	 postAccept(ring, conn);
+      }else if (conn->state == WANT_HANDSHAKE) {
+	 postHandshake(ring, conn);
+      }else if (conn->ringIO) {
+	 advanceFramed(ring, conn);
+      }else{
+	 postPoll(ring, conn);
+      }
+      conn = next;
+   }
+}
+
+/*******************************************************************
+ *Description: Event loop on io_uring. Connections are accepted by one
+ *   multishot accept, and everything queued while handling a batch of
+ *   completions is submitted by the same system call that waits for
+ *   the next batch.
+ *Parameters: Signal mask to wait with
+ *Returns: -1 if the kernel has no io_uring for us, otherwise 0 once a
+ *   stop signal arrives
+ * ****************************************************************/
+static int uringLoop(const sigset_t *waitMask) {
+   static const unsigned char ops[] = {
+      IORING_OP_ACCEPT, IORING_OP_RECVMSG, IORING_OP_POLL_ADD,
+      IORING_OP_RECV, IORING_OP_SEND
+   };
+   struct connection *conn, *next, *listener, *watched[MAX_LISTENERS];
+   struct io_uring_cqe *cqe;
+   struct uring ring;
+   uint64_t data;
+   unsigned flags;
+   int accepted = 0, syncPolled = 0;
+   int res, i;
+
+   if (uringInit(&ring, URING_ENTRIES) < 0) {
+      return -1;
+   }
+   if (uringProbe(&ring, ops, sizeof(ops)) < 0) {
+      uringExit(&ring);
+      return -1;
+   }
+   ring.waitMask = waitMask;
+   for (i = 0; i < listenerCount; i++) {
+      watched[i] = newListener(listeners[i]);
+      postAccept(&ring, watched[i]);
+   }
+
+   while (!stopping) {
+      // Whatever found the ring full goes in with this submission
+      resumeStalled(&ring);
+      if (syncEvents >= 0 && !syncPolled) {
+	 syncPolled = postSyncPoll(&ring) == 0;
+      }
+
+      if (uringSubmit(&ring, 1) < 0 && errno != EINTR && errno != EBUSY) {
+	 error("ERROR in io_uring_enter");
+      }
+
+      while ((cqe = uringPeek(&ring)) != NULL) {
+	 data = cqe->user_data;
+	 res = cqe->res;
+	 flags = cqe->flags;
+	 uringSeen(&ring);
+
+	 conn = (struct connection*)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+	 if ((data & OP_MASK) == OP_SYNC) {
+	    conn = takeSynced();
+	    while (conn != NULL) {
+	       next = conn->next;
+	       conn->syncing = 0;
+	       advanceFramed(&ring, conn);
+	       conn = next;
+	    }
+	    syncPolled = postSyncPoll(&ring) == 0;
+	    continue;
+	 }
+	 if ((data & OP_MASK) != OP_ACCEPT) {
+	    completeOp(&ring, conn, data & OP_MASK, res);
+	    continue;
+	 }
+
+	 listener = conn;
+	 // Kernels before 5.19 have no multishot accept and refuse it at
+	 // once, so this comes before any connection to hand over
+	 if (res == -EINVAL && accepted == 0) {
+	    stalledHead = stalledTail = NULL;
+	    uringExit(&ring);
+	    for (i = 0; i < listenerCount; i++) {
+	       free(watched[i]);
+	    }
+	    errno = EINVAL;
+	    return -1;
+	 }
+	 if (res >= 0) {
+	    accepted = 1;
+	    conn = newConnection(res);
+	    postHandshake(&ring, conn);
+	 }else if (res != -EINTR && res != -ECONNABORTED && res != -EPROTO) {
+	    fprintf(stderr, "SERVER: accept: %s\n", strerror(-res));
+	 }
+	 if (!(flags & IORING_CQE_F_MORE)) {
+	    postAccept(&ring, listener);
+	 }
+      }
+   }
+   uringExit(&ring);
+   for (i = 0; i < listenerCount; i++) {
+      free(watched[i]);
+   }
+   return 0;
+}
+
+/*******************************************************************
+ *Description: Pins the calling thread to one of the CPUs the daemon
+ *   may run on, picked by worker slot.
+ *Parameters: Worker slot
+ * ****************************************************************/
+static void pinToCpu(int slot) {
+   cpu_set_t allowed, one;
+   int count, cpu;
+
+   if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 ||
+	 (count = CPU_COUNT(&allowed)) == 0) {
+      perror("SERVER: sched_getaffinity");
+      return;
+   }
+
+   // The (slot mod count)th allowed CPU
+   slot %= count;
+   for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed) && slot-- == 0) {
+	 break;
+      }
+   }
+
+   CPU_ZERO(&one);
+   CPU_SET(cpu, &one);
+   if (sched_setaffinity(0, sizeof(one), &one) < 0) {
+      perror("SERVER: sched_setaffinity");
+   }
+}
+
+/*******************************************************************
+ *Description: Runs the chosen event loop in this process, counting
+ *   into its slot, until SIGTERM or SIGINT. The stop signals are
+ *   blocked except while the loop waits, so one cannot slip in
+ *   between its check of stopping and the wait.
+ *Parameters: Metrics slot
+ * ****************************************************************/
+static void workerLoop(int slot) {
+   sigset_t stops, waitMask;
+   struct sigaction sa;
+
+   metricsUse(slot);
+
+   // The slot's own socket takes the place of the shared one
+   if (shardSockets != NULL) {
+      listeners[0] = shardSockets[slot];
+   }
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = onStop;
+   sigaction(SIGTERM, &sa, NULL);
+   sigaction(SIGINT, &sa, NULL);
+   sigemptyset(&stops);
+   sigaddset(&stops, SIGTERM);
+   sigaddset(&stops, SIGINT);
+   // Cipher threads inherit the blocked mask and leave the stops to us
+   pthread_sigmask(SIG_BLOCK, &stops, &waitMask);
+   sigdelset(&waitMask, SIGTERM);
+   sigdelset(&waitMask, SIGINT);
+
+   // Threads do not survive fork(), so each worker starts its own
+   if (cipherThreads > 1 && cipherStartThreads(cipherThreads) < 0) {
+      error("ERROR starting cipher threads");
+   }
+   if (useLedger && (syncEvents = ledgerSyncStart()) < 0) {
+      error("ERROR starting the key ledger sync thread");
+   }
+   // Pinned after they start, so the cipher threads keep every CPU
+   if (pinWorkers) {
+      pinToCpu(slot);
+   }
+
+   if (useUring) {
+      if (uringLoop(&waitMask) == 0) {
+	 return;
+      }
+      perror("SERVER: io_uring unavailable, using epoll");
+   }
+   eventLoop(&waitMask);
+}
+
+static pid_t spawnWorker(int slot) {
+   pid_t pid = fork();
+
+   if (pid < 0) {
+      error("Fork failed");
+   }else if (pid == 0) {
+      workerLoop(slot);
+      // exit() rather than _exit(), so profiling and sanitizer builds
+      // write out what they collected
+      exit(0);
+   }
+   return pid;
+}
+
+/*******************************************************************
+ *Description: Forks the worker pool and keeps it at full strength,
+ *   replacing workers that die.
+ *Parameters: Pool size
+ * ****************************************************************/
+static void runPool(int workers) {
+   pid_t *pids = calloc(workers, sizeof(pid_t));
+   struct sigaction sa;
+   pid_t pid;
+   int i;
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = onStop;
+   sigaction(SIGTERM, &sa, NULL);
+   sigaction(SIGINT, &sa, NULL);
+
+   for (i = 0; i < workers; i++) {
+      pids[i] = spawnWorker(i);
+   }
+
+   while (!stopping) {
+      pid = waitpid(-1, NULL, 0);
+      if (pid < 0) {
+	 if (errno == EINTR) {
+	    continue;
+	 }
+	 error("ERROR waiting for workers");
+      }
+
+      // Refill the slot the worker held
+      for (i = 0; i < workers; i++) {
+	 if (pids[i] == pid) {
+	    pids[i] = stopping ? 0 : spawnWorker(i);
+	    break;
+	 }
+      }
+   }
+
+   for (i = 0; i < workers; i++) {
+      if (pids[i] > 0) {
+	 kill(pids[i], SIGTERM);
+      }
+   }
+   while (wait(NULL) > 0);
+   free(pids);
+}
+
+int runServer(int argc, char *argv[], const char *types) {
+   int workers = -1, statsPort = 0;
+   int reusePort = 0;
+   char *localPath = NULL;
+   char *journalPath = NULL;
+   int opt, port, i;
+
+   serviceTypes = types;
+
+   while ((opt = getopt(argc, argv, "uraw:t:b:k:m:L:J:")) != -1) {
+      switch (opt) {
+	 case 'u':
+	    useUring = 1;
+	    break;
+	 case 'r':
+	    reusePort = 1;
+	    break;
+	 case 'a':
+	    pinWorkers = 1;
+	    break;
+	 case 'b':
+	    backlog = atoi(optarg);
+	    break;
+	 case 'L':
+	    localPath = optarg;
+	    break;
+	 case 'J':
+	    journalPath = optarg;
+	    break;
+	 case 'm':
+	    statsPort = atoi(optarg);
+	    break;
+	 case 'w':
+	    workers = atoi(optarg);
+	    break;
+	 case 't':
+	    cipherThreads = atoi(optarg);
+	    break;
+	 case 'k':
+	    // Loaded before forking so workers share the mappings
+	    if (keystoreAdd(optarg) < 0) {
+	       exit(1);
+	    }
+	    break;
+	 default:
+	    usage(argv[0]);
+      }
+   }
+
+   // Check usage & args
+   if (optind >= argc || workers < -1 || cipherThreads < 1 || statsPort < 0 ||
+	 backlog < 1) {
+      usage(argv[0]);
+   }
+   port = atoi(argv[optind]);
+
+   // Sharded listeners want a worker per CPU unless told otherwise
+   if (workers < 0) {
+      workers = reusePort ? sysconf(_SC_NPROCESSORS_ONLN) : 0;
+   }
+
+   // Like the pads, the ledger is shared by the workers
+   if (journalPath != NULL) {
+      if (keystoreLedger(journalPath) < 0) {
+	 exit(1);
+      }
+      useLedger = 1;
+   }
+
+   // Slots are mapped before forking so the workers share them
+   if (metricsInit(workers) < 0) {
+      error("ERROR mapping metrics");
+   }
+   if (statsPort > 0 && metricsServe(statsPort) < 0) {
+      error("ERROR opening stats socket");
+   }
+
+   // A client vanishing mid-reply must not take the process with it
+   signal(SIGPIPE, SIG_IGN);
+
+   // With -r every worker slot gets a socket of its own, opened here
+   // so a bind error stops the daemon and a replacement worker takes
+   // over the queue of the one that died
+   if (reusePort && workers > 0) {
+      shardSockets = calloc(workers, sizeof(int));
+      if (shardSockets == NULL) {
+	 error("ERROR allocating listeners");
+      }
+      for (i = 0; i < workers; i++) {
+	 shardSockets[i] = listenPort(port, 1);
+      }
+      listeners[listenerCount++] = shardSockets[0];
+   }else{
+      listeners[listenerCount++] = listenPort(port, reusePort);
+   }
+
+   if (localPath != NULL) {
+      listeners[listenerCount++] = listenLocal(localPath);
+   }
+
+   if (workers > 0) {
+      runPool(workers);
+   }else{
+      workerLoop(0);
+   }
+
+   // Close the listening sockets
+   if (shardSockets != NULL) {
+      for (i = 1; i < workers; i++) {
+	 close(shardSockets[i]);
+      }
+      free(shardSockets);
+   }
+   while (listenerCount > 0) {
+      close(listeners[--listenerCount]);
+   }
+   if (localPath != NULL) {
+      unlink(localPath);
+   }
+   return 0;
+}
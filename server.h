@@ -0,0 +1,47 @@
+/*****************************************************************
+*Description: Listening socket, worker management and the event
+*   loop shared by enc_server, dec_server and otp_server.
+* ***************************************************************/
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "cipher.h"
+
+void error(const char *msg);
+
+/*******************************************************************
+ *Description: Parses the daemon arguments, binds the listening socket
+ *   and serves connections until killed.
+ *   USAGE: prog [-u] [-r] [-a] [-w workers] [-t threads] [-b backlog]
+ *               [-m stats port] [-k id=pad ...] [-J journal]
+ *               [-L socket] port
+ *   Connections are multiplexed by an epoll event loop, or with -u by
+ *   an io_uring loop where the kernel has one. Without -w the
+ *   loop runs in the daemon itself; with -w a pool of workers is forked
+ *   up front, each running its own loop on the shared listening socket,
+ *   and the parent replaces any worker that exits. With -r each worker
+ *   listens on a socket of its own bound with SO_REUSEPORT, so the
+ *   kernel spreads connections over separate accept queues; -r without
+ *   -w forks one worker per online CPU. -a pins each worker's loop to a
+ *   CPU. -b sets the accept backlog (4096, capped by the kernel's
+ *   somaxconn). With -t each loop ciphers large chunks across that
+ *   many threads. Each -k maps a pad file that jobs can then name by
+ *   its ID instead of sending a key. With -J every pad range a job
+ *   encrypts with is recorded in a key-usage ledger kept in that
+ *   journal file (see ledger.h), and a job asking for a range used
+ *   before is refused.
+ *   With -m the daemon's counters and latency histograms, summed over
+ *   its workers, are served on 127.0.0.1 at that port for Prometheus.
+ *   With -L the daemon also listens on a Unix socket at that path,
+ *   where framed clients may pass their jobs in shared memory. The
+ *   socket has mode 0600, so only the daemon's user may connect.
+ *   Each connection is ciphered in the direction its handshake asks
+ *   for ('e' encrypts, 'd' decrypts), so one daemon serving both
+ *   shares its workers and buffers between them. Clients asking for a
+ *   type not served are rejected.
+ *Parameters: argc/argv of the daemon, handshake bytes it serves
+ *   ("e", "d" or "ed")
+ * ****************************************************************/
+int runServer(int argc, char *argv[], const char *types);
+
+#endif
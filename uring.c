@@ -0,0 +1,171 @@
+/*****************************************************************
+*Description: io_uring set up and ring handling (see uring.h). The
+*   kernel reads the submission tail and writes the completion tail
+*   concurrently, so those are loaded with acquire and stored with
+*   release ordering.
+* ***************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int setup(unsigned entries, struct io_uring_params *p, unsigned flags) {
+   memset(p, 0, sizeof(*p));
+   p->flags = flags;
+   return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int uringInit(struct uring *ring, unsigned entries) {
+   struct io_uring_params p;
+
+   memset(ring, 0, sizeof(*ring));
+
+   // Only this thread submits, and completions can wait for the next
+   // io_uring_enter() instead of interrupting it. Older kernels do
+   // without.
+   ring->fd = setup(entries, &p,
+	 IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+   if (ring->fd < 0 && errno == EINVAL) {
+      ring->fd = setup(entries, &p, 0);
+   }
+   if (ring->fd < 0) {
+      return -1;
+   }
+
+   ring->sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   ring->cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      if (ring->cqMapLen > ring->sqMapLen) {
+	 ring->sqMapLen = ring->cqMapLen;
+      }
+      ring->cqMapLen = 0;
+   }
+
+   ring->sqMap = mmap(NULL, ring->sqMapLen, PROT_READ | PROT_WRITE,
+	 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+   if (ring->sqMap == MAP_FAILED) {
+      close(ring->fd);
+      return -1;
+   }
+   ring->cqMap = ring->sqMap;
+   if (ring->cqMapLen > 0) {
+      ring->cqMap = mmap(NULL, ring->cqMapLen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cqMap == MAP_FAILED) {
+	 munmap(ring->sqMap, ring->sqMapLen);
+	 close(ring->fd);
+	 return -1;
+      }
+   }
+
+   ring->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+   ring->sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE,
+	 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+   if (ring->sqes == MAP_FAILED) {
+      uringExit(ring);
+      return -1;
+   }
+
+   ring->sqHead = (unsigned*)((char*)ring->sqMap + p.sq_off.head);
+   ring->sqTail = (unsigned*)((char*)ring->sqMap + p.sq_off.tail);
+   ring->sqMask = (unsigned*)((char*)ring->sqMap + p.sq_off.ring_mask);
+   ring->sqArray = (unsigned*)((char*)ring->sqMap + p.sq_off.array);
+   ring->cqHead = (unsigned*)((char*)ring->cqMap + p.cq_off.head);
+   ring->cqTail = (unsigned*)((char*)ring->cqMap + p.cq_off.tail);
+   ring->cqMask = (unsigned*)((char*)ring->cqMap + p.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe*)((char*)ring->cqMap + p.cq_off.cqes);
+   return 0;
+}
+
+int uringProbe(struct uring *ring, const unsigned char *ops, int count) {
+   struct io_uring_probe *probe;
+   size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+   int i, rc = 0;
+
+   probe = calloc(1, size);
+   if (probe == NULL) {
+      return -1;
+   }
+   if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+	    probe, 256) < 0) {
+      free(probe);
+      return -1;
+   }
+   for (i = 0; i < count; i++) {
+      if (ops[i] > probe->last_op ||
+	    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+	 errno = EOPNOTSUPP;
+	 rc = -1;
+	 break;
+      }
+   }
+   free(probe);
+   return rc;
+}
+
+struct io_uring_sqe* uringGet(struct uring *ring) {
+   struct io_uring_sqe *sqe;
+   unsigned tail = *ring->sqTail;
+   unsigned index;
+
+   while (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >
+	 *ring->sqMask) {
+      if (uringSubmit(ring, 0) < 0) {
+	 return NULL;
+      }
+   }
+
+   index = tail & *ring->sqMask;
+   sqe = &ring->sqes[index];
+   memset(sqe, 0, sizeof(*sqe));
+   ring->sqArray[index] = index;
+   __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+   ring->queued++;
+   return sqe;
+}
+
+unsigned uringRoom(struct uring *ring) {
+   return *ring->sqMask + 1 -
+      (*ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE));
+}
+
+int uringSubmit(struct uring *ring, unsigned wait) {
+   const sigset_t *mask = wait > 0 ? ring->waitMask : NULL;
+   int n;
+
+   n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+	 wait > 0 ? IORING_ENTER_GETEVENTS : 0, mask, mask ? _NSIG / 8 : 0);
+   if (n < 0) {
+      return -1;
+   }
+   ring->queued -= n;
+   return 0;
+}
+
+struct io_uring_cqe* uringPeek(struct uring *ring) {
+   unsigned head = *ring->cqHead;
+
+   if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+      return NULL;
+   }
+   return &ring->cqes[head & *ring->cqMask];
+}
+
+void uringSeen(struct uring *ring) {
+   __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+void uringExit(struct uring *ring) {
+   if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqesLen);
+   }
+   if (ring->cqMapLen > 0) {
+      munmap(ring->cqMap, ring->cqMapLen);
+   }
+   munmap(ring->sqMap, ring->sqMapLen);
+   close(ring->fd);
+}
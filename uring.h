@@ -0,0 +1,62 @@
+/*****************************************************************
+*Description: A minimal io_uring wrapper over the raw system calls,
+*   enough for the daemons' io_uring event loop. Submissions are
+*   queued with uringGet() and all go to the kernel in the one
+*   io_uring_enter() call that also waits for completions.
+* ***************************************************************/
+#ifndef URING_H
+#define URING_H
+
+#include <signal.h>
+#include <linux/io_uring.h>
+
+struct uring {
+   int fd;
+   unsigned *sqHead;
+   unsigned *sqTail;
+   unsigned *sqMask;
+   unsigned *sqArray;
+   struct io_uring_sqe *sqes;
+   unsigned *cqHead;
+   unsigned *cqTail;
+   unsigned *cqMask;
+   struct io_uring_cqe *cqes;
+   unsigned queued;	// Submissions not yet passed to the kernel
+   // Signal mask while waiting for completions, NULL to keep the
+   // thread's; like ppoll(), signals blocked outside can then only
+   // arrive while the ring waits
+   const sigset_t *waitMask;
+   void *sqMap, *cqMap;
+   size_t sqMapLen, cqMapLen, sqesLen;
+};
+
+// Sets up a ring of entries submissions. Returns 0, or -1 with errno
+// set, for example on kernels without io_uring.
+int uringInit(struct uring *ring, unsigned entries);
+
+// Returns 0 if the kernel supports all count opcodes in ops, or -1
+// with errno EOPNOTSUPP if not. Kernels before 5.6 cannot say and
+// fail with their own errno.
+int uringProbe(struct uring *ring, const unsigned char *ops, int count);
+
+// Next free submission, zeroed. Submits what is queued first if the
+// ring is full, and returns NULL with errno set if that fails; the
+// kernel may be out of memory or holding completions not yet seen.
+struct io_uring_sqe* uringGet(struct uring *ring);
+
+// Submissions uringGet() can hand out before it has to submit
+unsigned uringRoom(struct uring *ring);
+
+// Submits what is queued and waits for at least wait completions.
+// Returns 0, or -1 with errno set.
+int uringSubmit(struct uring *ring, unsigned wait);
+
+// Oldest completion not yet seen, or NULL
+struct io_uring_cqe* uringPeek(struct uring *ring);
+
+// Hands the completion uringPeek() returned back to the kernel
+void uringSeen(struct uring *ring);
+
+void uringExit(struct uring *ring);
+
+#endif